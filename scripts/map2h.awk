@@ -0,0 +1,217 @@
+#! /usr/bin/gawk -f
+
+# Key mapping CSV to keymap.h: the MAT_PET_KEY_* defines, and with
+# KEYMAP_TABLES defined, the ascii_map and key_tbl flash tables.  See
+# keymap.csv for the format.  Fails on duplicate or conflicting lines.
+#
+# Run as map2h.awk vkb_pet.h keymap.csv.  The SCAN_C64_KEY_* and
+# SCAN_C128_KEY_* defines in vkb_pet.h give the scan code each C64 key
+# name stands for, so two names for one scan code are caught, too.
+
+function fail(msg) {
+  printf "%s:%d: %s\n", FILENAME, FNR, msg > "/dev/stderr"
+  errors++
+}
+
+# split a CSV line into f[1..n], returns n
+function csv(line, f,    n, c, q, i, v) {
+  n = 0
+  v = ""
+  q = 0
+  for(i = 1; i <= length(line); i++) {
+    c = substr(line, i, 1)
+    if(q) {
+      if(c == "\"") {
+        if(substr(line, i + 1, 1) == "\"") {
+          v = v c
+          i++
+        } else {
+          q = 0
+        }
+      } else {
+        v = v c
+      }
+    } else if(c == "\"") {
+      q = 1
+    } else if(c == ",") {
+      f[++n] = v
+      v = ""
+    } else {
+      v = v c
+    }
+  }
+  if(q)
+    fail("unterminated quote")
+  f[++n] = v
+  return n
+}
+
+# character to a C character constant, empty to 0
+function cchar(c) {
+  if(c == "")
+    return "0"
+  if(c == "\\" || c == "'")
+    return "'\\" c "'"
+  return "'" c "'"
+}
+
+# PET key field to a switch value, ~ flips shift, empty is NONE
+function petkey(k,    flip) {
+  flip = sub(/^~/, "", k)
+  if(k == "")
+    k = "NONE"
+  if(!(k in matrix))
+    fail("unknown PET key " k)
+  return "MAT_PET_KEY_" k (flip ? " | SW_SHIFT_OVERRIDE" : "")
+}
+
+BEGIN {
+  for(i = 32; i < 127; i++)
+    ord[sprintf("%c", i)] = i
+}
+
+{ sub(/\r$/, "") }
+
+# C64 key names and their scan codes, from the header
+FILENAME ~ /\.h$/ {
+  if($1 != "#define" || $2 !~ /^SCAN_C(64|128)_KEY_/)
+    next
+  if(NF != 3 || $3 !~ /^SCAN_MAP(_K)?\([0-9],[0-7]\)$/) {
+    fail("can't read " $2)
+    next
+  }
+  # SCAN_C64_KEY_A is C64_A
+  name = $2
+  sub(/^SCAN_/, "", name)
+  sub(/_KEY_/, "_", name)
+  if($3 in keyat)
+    fail("C64 keys " keyat[$3] " and " name " are both " $3)
+  keyat[$3] = name
+  code[name] = $3
+  next
+}
+
+/^#/ || /^[ \t]*$/ { next }
+
+{ n = csv($0, f) }
+
+f[1] == "matrix" {
+  if(n != 4 || f[3] !~ /^[0-9]$/ || f[4] !~ /^[0-7]$/) {
+    fail("bad matrix line")
+    next
+  }
+  if(f[2] in matrix)
+    fail("PET key " f[2] " already at " matrix[f[2]])
+  pos = f[3] "," f[4]
+  if(pos in at)
+    fail("PET keys " at[pos] " and " f[2] " both at " pos)
+  matrix[f[2]] = pos
+  at[pos] = f[2]
+  names[++nnames] = f[2]
+  next
+}
+
+f[1] == "ascii" {
+  if(n != 3 || length(f[2]) != 1 || !(f[2] in ord)) {
+    fail("bad ascii line")
+    next
+  }
+  c = ord[f[2]]
+  if(c in ascii)
+    fail("character " f[2] " already mapped")
+  ascii[c] = f[3]
+  aline[c] = FNR
+  if(c > amax)
+    amax = c
+  next
+}
+
+f[1] == "key" {
+  if(n < 3 || n > 8 || length(f[2]) > 1 || f[3] !~ /^C(64|128)_[A-Z0-9_]+$/) {
+    fail("bad key line")
+    next
+  }
+  for(i = n + 1; i <= 8; i++)
+    f[i] = ""
+  if(!(f[3] in code))
+    fail("unknown C64 key " f[3])
+  else if(f[3] in scan)
+    fail("C64 key " f[3] " already mapped")
+  else if(code[f[3]] in used)
+    fail("C64 keys " used[code[f[3]]] " and " f[3] " both map " code[f[3]])
+  else
+    used[code[f[3]]] = f[3]
+  scan[f[3]] = 1
+  if(f[7] == "")
+    flags = "KEY_FL_MAP"
+  else if(f[7] == "cfg_shift")
+    flags = "KEY_FL_MAP | KEY_FL_CFG_SHIFT"
+  else if(f[7] == "func")
+    flags = "KEY_FL_FUNC"
+  else
+    fail("unknown flags " f[7])
+  if(f[7] == "func" && f[4] f[5] f[6] != "")
+    fail("function key " f[3] " with PET keys")
+  k = ++nkeys
+  kdef[k] = f[8]
+  kline[k] = FNR
+  kent[k] = f[2] SUBSEP f[3] SUBSEP flags SUBSEP f[4] SUBSEP f[5] SUBSEP f[6]
+  next
+}
+
+{ fail("unknown line type " f[1]) }
+
+END {
+  if(!("NONE" in matrix))
+    fail("no NONE in the matrix")
+  # keys are checked once the whole matrix is known
+  for(c = 32; c <= amax; c++) {
+    if(c in ascii) {
+      FNR = aline[c]
+      ascii[c] = petkey(ascii[c])
+    }
+  }
+  for(k = 1; k <= nkeys; k++) {
+    split(kent[k], e, SUBSEP)
+    FNR = kline[k]
+    # C64_A is SCAN_C64_KEY_A
+    name = e[2]
+    sub(/_/, "_KEY_", name)
+    kent[k] = sprintf("[SCAN_%s] = {%s, %s, %s, %s, %s}", name, cchar(e[1]),
+                      e[3], petkey(e[4]), petkey(e[5]), petkey(e[6]))
+  }
+  if(errors)
+    exit 1
+
+  print "// keymap.h generated from " FILENAME " by scripts/map2h.awk\n" \
+    "#ifndef KEYMAP_H\n" \
+    "#define KEYMAP_H\n"
+  for(i = 1; i <= nnames; i++) {
+    split(matrix[names[i]], p, ",")
+    printf "#define %-26s MATRIX_MAP(%d,%d)\n", "MAT_PET_KEY_" names[i], p[1], p[2]
+  }
+  print "\n#endif\n"
+
+  print "#ifdef KEYMAP_TABLES\n" \
+    "static const uint8_t ascii_map[] PROGMEM = {"
+  for(c = 32; c <= amax; c++)
+    printf "  %s,\n", (c in ascii ? ascii[c] : "MAT_PET_KEY_NONE")
+  print "};\n\n" \
+    "// indexed by scan code, codes left out have no flags and map to nothing\n" \
+    "static const keydef_t key_tbl[KB_CODES] PROGMEM = {"
+  cond = ""
+  for(k = 1; k <= nkeys; k++) {
+    if(kdef[k] != cond) {
+      if(cond != "")
+        print "#endif"
+      if(kdef[k] != "")
+        print "#ifdef " kdef[k]
+      cond = kdef[k]
+    }
+    print "  " kent[k] ","
+  }
+  if(cond != "")
+    print "#endif"
+  print "};\n" \
+    "#endif"
+}
@@ -0,0 +1,50 @@
+#! /usr/bin/gawk -f
+
+# RAM use per module, from "avr-size -A" run on the object files, then
+# the linked total and what is left for the stack.  Pass the linked
+# __data_start and __heap_start as data_start and heap_start (avr-nm
+# values, hex) and the MCU's RAMEND as ramend.  Sections are summed by
+# name: -B would count .eeprom as .data and leave out .rodata, which
+# the AVR copies to RAM with .data.
+
+# hex string, with or without 0x, to a number
+function hex(s,    i, n) {
+  sub(/^0[xX]/, "", s)
+  n = 0
+  for(i = 1; i <= length(s); i++)
+    n = n * 16 + index("0123456789abcdef", tolower(substr(s, i, 1))) - 1
+  return n
+}
+
+BEGIN {
+  printf "%-20s %6s %6s\n", "module", ".data", ".bss"
+}
+
+# "file.o  :" starts each object
+$2 == ":" {
+  n = split($1, path, "/")
+  name = path[n]
+  mdata = 0
+  mbss = 0
+  next
+}
+
+$1 ~ /^\.(data|rodata)/ { mdata += $2 }
+$1 ~ /^\.bss/ || $1 == "COMMON" { mbss += $2 }
+
+$1 == "Total" {
+  printf "%-20s %6d %6d\n", name, mdata, mbss
+  data += mdata
+  bss += mbss
+}
+
+END {
+  printf "%-20s %6d %6d  (before unused sections are dropped)\n", "objects", data, bss
+  # data space symbols are offset by 0x800000
+  start = hex(data_start) % 65536
+  end = hex(heap_start) % 65536
+  gsub(/[()]/, "", ramend)
+  top = hex(ramend)
+  printf "linked .data+.bss %d bytes, stack headroom %d of %d bytes\n", \
+         end - start, top + 1 - end, top + 1 - start
+}
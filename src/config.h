@@ -25,6 +25,7 @@
 #define FLASH_MEM_DATA  1
 
 #include <avr/io.h>
+#include <avr/pgmspace.h>
 #include <util/delay.h>
 
 #ifndef ARDUINO
@@ -38,6 +39,19 @@
 #define CONFIG_UART_DEBUG_FLUSH
 #define CONFIG_UART_BUF_SHIFT     8
 
+// Keyboard debounce depth
+#define CONFIG_KB_DEBOUNCE        2
+#define CONFIG_KB_GHOST_FILTER
+#define CONFIG_KB_IDLE_TIMEOUT    2000
+#define CONFIG_KB_FAST_SCAN
+#define CONFIG_KB_SETTLE_US       32
+#define CONFIG_KB_FAST_ISR
+//#define CONFIG_ISR_TIMING
+//#define CONFIG_KB_C128
+//#define CONFIG_KB_DUAL
+#define CONFIG_JOYSTICK
+//#define CONFIG_PET_SYNC
+
 #endif
 
 #ifndef TRUE
@@ -74,14 +88,146 @@
 #elif CONFIG_HARDWARE_VARIANT == 2 || defined ARDUINO_AVR_MEGA2560
 /* ---------- Hardware configuration: PETKey Arduino ---------- */
 
+#ifdef CONFIG_KB_C128
+// C128 K0-K2 lines on PG0, PG1 and PG5.  PG2 is the crosspoint AX1 line.
+#  define KB_KLINE_OUT      PORTG
+#  define KB_KLINE_IN       PING
+#  define KB_KLINE_DDR      DDRG
+#  define KB_KLINE_MASK     (_BV(PIN0) | _BV(PIN1) | _BV(PIN5))
+
+static inline void kb2_init(void) {
+  KB_KLINE_DDR &= (uint8_t)~KB_KLINE_MASK;
+  KB_KLINE_OUT |= KB_KLINE_MASK;  // turn on pullups.
+}
+
+// K0-K2 in bits 0-2, read with each row like a second keyboard's columns
+static inline uint8_t kb_read_col2(void) {
+  uint8_t in = (uint8_t)~KB_KLINE_IN;
+
+  return (in & 0x03) | (in >> 3 & 0x04);
+}
+#endif
+
+#ifdef CONFIG_KB_DUAL
+// second keyboard, rows on PORTF, columns on PORTK
+#  define KB2_ROW_OUT       PORTF
+#  define KB2_ROW_DDR       DDRF
+#  define KB2_COL_OUT       PORTK
+#  define KB2_COL_IN        PINK
+
+static inline void kb2_init(void) {
+  uint8_t tmp = MCUCR | _BV(JTD);
+
+  // PF4-PF7 are JTAG pins unless JTD is written twice within 4 cycles
+  MCUCR = tmp;
+  MCUCR = tmp;
+  KB2_COL_OUT = 0xff;           // turn on pullups.
+}
+#endif
+
+#ifdef CONFIG_JOYSTICK
+// joystick 1 on PB0-PB5, joystick 2 on PH0, PH1 and PH3-PH6, each in
+// the order up, down, left, right, fire 1, fire 2.  PB0-PB3 are the SPI
+// and ISP pins and PH0/PH1 are RXD2/TXD2, so with joysticks fitted there
+// is no SPI and no USART2; unplug joystick 1 to program over ISP.
+#  define JOY_PORTS         2
+#  define JOY1_MASK         0x3f
+#  define JOY2_MASK         0x7b
+
+static inline void joy_init_ports(void) {
+  DDRB &= (uint8_t)~JOY1_MASK;
+  PORTB |= JOY1_MASK;           // turn on pullups.
+  DDRH &= (uint8_t)~JOY2_MASK;
+  PORTH |= JOY2_MASK;
+}
+
+// closed lines read as 1, up in bit 0 through fire 2 in bit 5
+static inline uint8_t joy_read(uint8_t port) {
+  uint8_t in;
+
+  if(port == 0)
+    return (uint8_t)~PINB & JOY1_MASK;
+  in = (uint8_t)~PINH & JOY2_MASK;
+  return (in & 0x03) | (in >> 1 & 0x3c);
+}
+#endif
+
+#ifdef CONFIG_PET_SYNC
+// PET keyboard row line scanned last on PD0/INT0, rising as it moves on
+#  define PET_SYNC_VECT     INT0_vect
+
+static inline void pet_sync_init(void) {
+  DDRD &= ~_BV(PIN0);
+  PORTD |= _BV(PIN0);           // quiet with no PET attached
+  EICRA |= _BV(ISC01) | _BV(ISC00);    // rising edge
+  EIFR = _BV(INTF0);
+  EIMSK |= _BV(INT0);
+}
+#endif
+
 #define SCAN_TIMER          TIMER0_COMPA_vect
+// every row 120 times a second
+#define SCAN_RATE           (120 * 8)
+
+#ifdef CONFIG_KB_FAST_SCAN
+#  define KB_FAST_SCAN
+// columns are sampled on compare B, after the row has settled
+#  define SCAN_SAMPLE_TIMER TIMER0_COMPB_vect
+#  define SCAN_TIMER_IRQS   (_BV(OCIE0A) | _BV(OCIE0B))
+#  if (CONFIG_KB_SETTLE_US * (F_CPU / 1000000) / 256) > 1
+#    define KB_SETTLE_OCR   ((CONFIG_KB_SETTLE_US * (F_CPU / 1000000) / 256) - 1)
+#  else
+#    define KB_SETTLE_OCR   0
+#  endif
+#else
+#  define SCAN_TIMER_IRQS   _BV(OCIE0A)
+#endif
 
 static inline void timer_init(void) {
-  // need to scan 120 * 8 times a sec
+  // need to scan 120 * rows times a sec
   TCCR0A = _BV(WGM01);            // CTC mode
-  TCCR0B = _BV(CS02) | _BV(CS00); // /1024
-  OCR0A = (F_CPU / 1024 / 120 / 8) - 1;
+  TCCR0B = _BV(CS02);             // /256
+  OCR0A = (F_CPU / 256 / SCAN_RATE) - 1;
+#ifdef KB_FAST_SCAN
+  // compare B fires (OCR0B + 1) timer clocks after compare A
+  OCR0B = KB_SETTLE_OCR;
+#endif
+  TIMSK0 = SCAN_TIMER_IRQS;
+}
+
+// drop to the slowest rate (~61 Hz) while the keyboard is idle
+static inline void timer_set_idle(void) {
   TIMSK0 = _BV(OCIE0A);
+  TCCR0B = _BV(CS02) | _BV(CS00); // /1024
+  OCR0A = 255;
+}
+
+// timer 1 counts CPU cycles for measurements, and is stopped otherwise.
+#define CYCLE_COUNTER
+
+static inline void cycles_start(void) {
+  TCCR1A = 0;
+  TCNT1 = 0;
+  TCCR1B = _BV(CS10);           // CPU clock
+}
+
+static inline uint16_t cycles_read(void) {
+  return TCNT1;
+}
+
+static inline uint16_t cycles_stop(void) {
+  uint16_t t = TCNT1;
+
+  TCCR1B = 0;
+  return t;
+}
+
+static inline void timer_set_active(void) {
+  TCCR0B = _BV(CS02);             // /256
+  TCNT0 = 0;
+  OCR0A = (F_CPU / 256 / SCAN_RATE) - 1;
+  TIFR0 = _BV(OCF0B);
+  TIMSK0 = SCAN_TIMER_IRQS;
 }
 
 // rmeove hi port.
@@ -91,6 +237,9 @@ static inline void timer_init(void) {
 #define KB_COL_OUT          PORTA
 #define KB_COL_IN           PINA
 #define KB_COL_DDR          DDRA
+// PORTA has no pin change interrupts on the 2560, so the idle scanner polls
+// the columns.  Boards with the columns on a PCINT port can define
+// KB_COL_PCMSK, KB_COL_PCIE and KB_COL_PCINT_vect to wake immediately.
 
 #define XPT_RESET_DDR       DDRC
 #define XPT_RESET_OUT       PORTC
@@ -157,6 +306,13 @@ static inline void timer_init(void) {
 #  error "CONFIG_HARDWARE_VARIANT is unset or set to an unknown value."
 #endif
 
+// open every switch at once
+static inline void xpt_reset(void) {
+  XPT_RESET_OUT |= _BV(XPT_RESET_PIN);
+  _delay_us(1);
+  XPT_RESET_OUT &= ~_BV(XPT_RESET_PIN);
+}
+
 static inline void xpt_init(void) {
   XPT_STROBE_OUT &= ~_BV(XPT_STROBE_PIN);
 
@@ -171,53 +327,46 @@ static inline void xpt_init(void) {
   XPT_DATA_DDR |= _BV(XPT_DATA_PIN);
   XPT_STROBE_DDR |= _BV(XPT_STROBE_PIN);
 
-  XPT_RESET_OUT |= _BV(XPT_RESET_PIN);
-  _delay_us(1);
-  XPT_RESET_OUT &= ~_BV(XPT_RESET_PIN);
-
+  xpt_reset();
 }
 
-// bits are 0 AY2,1,0,AX3,2,1,0
+/*
+ * Every crosspoint line but AX1 is on PORTC, so a switch address is one
+ * PORTC write, taken from a table, plus the AX1 bit on PORTG.  RESET is
+ * left low by the table.
+ */
+#define XPT_ADDR_OUT        PORTC
+#define XPT_ADDR(sw)        (((sw) & 1 ? _BV(XPT_AX0_PIN) : 0)    \
+                             | ((sw) & 4 ? _BV(XPT_AX2_PIN) : 0)  \
+                             | ((sw) & 8 ? _BV(XPT_AX3_PIN) : 0)  \
+                             | ((sw) & 16 ? _BV(XPT_AY0_PIN) : 0) \
+                             | ((sw) & 32 ? _BV(XPT_AY1_PIN) : 0) \
+                             | ((sw) & 64 ? _BV(XPT_AY2_PIN) : 0))
+#define XPT_ADDR_4(sw)      XPT_ADDR(sw), XPT_ADDR((sw) + 1), \
+                            XPT_ADDR((sw) + 2), XPT_ADDR((sw) + 3)
+#define XPT_ADDR_16(sw)     XPT_ADDR_4(sw), XPT_ADDR_4((sw) + 4), \
+                            XPT_ADDR_4((sw) + 8), XPT_ADDR_4((sw) + 12)
+#define XPT_ADDR_64(sw)     XPT_ADDR_16(sw), XPT_ADDR_16((sw) + 16), \
+                            XPT_ADDR_16((sw) + 32), XPT_ADDR_16((sw) + 48)
+
+/*
+ * bits are 0 AY2,1,0,AX3,2,1,0.  The MT8816 wants 10-20ns of setup, hold
+ * and strobe width, one clock is 62.5ns, so no delays are needed.
+ */
 static inline void xpt_send(uint8_t sw, uint8_t data) {
-  if(sw & 1)
-    XPT_AX0_OUT |= _BV(XPT_AX0_PIN);
-  else
-    XPT_AX0_OUT &= ~_BV(XPT_AX0_PIN);
+  static const uint8_t addr[128] PROGMEM = {XPT_ADDR_64(0), XPT_ADDR_64(64)};
+  uint8_t out = pgm_read_byte(&addr[sw & 0x7f]);
+
+  if(data)
+    out |= _BV(XPT_DATA_PIN);
   if(sw & 2)
     XPT_AX1_OUT |= _BV(XPT_AX1_PIN);
   else
     XPT_AX1_OUT &= ~_BV(XPT_AX1_PIN);
-  if(sw & 4)
-    XPT_AX2_OUT |= _BV(XPT_AX2_PIN);
-  else
-    XPT_AX2_OUT &= ~_BV(XPT_AX2_PIN);
-  if(sw & 8)
-    XPT_AX3_OUT |= _BV(XPT_AX3_PIN);
-  else
-    XPT_AX3_OUT &= ~_BV(XPT_AX3_PIN);
-
-  if(sw & 16)
-    XPT_AY0_OUT |= _BV(XPT_AY0_PIN);
-  else
-    XPT_AY0_OUT &= ~_BV(XPT_AY0_PIN);
-  if(sw & 32)
-    XPT_AY1_OUT |= _BV(XPT_AY1_PIN);
-  else
-    XPT_AY1_OUT &= ~_BV(XPT_AY1_PIN);
-  if(sw & 64)
-    XPT_AY2_OUT |= _BV(XPT_AY2_PIN);
-  else
-    XPT_AY2_OUT &= ~_BV(XPT_AY2_PIN);
-
-  if(data)
-    XPT_DATA_OUT |= _BV(XPT_DATA_PIN);
-  else
-    XPT_DATA_OUT &= ~_BV(XPT_DATA_PIN);
+  XPT_ADDR_OUT = out;
 
   XPT_STROBE_OUT |= _BV(XPT_STROBE_PIN);
-  _delay_us(1);
   XPT_STROBE_OUT &= ~_BV(XPT_STROBE_PIN);
-  _delay_us(1);
 }
 
 #define SCAN_ROW_0          7
@@ -229,30 +378,121 @@ static inline void xpt_send(uint8_t sw, uint8_t data) {
 #define SCAN_ROW_6          6
 #define SCAN_ROW_7          0
 
-#define SCAN_COL_0          7
-#define SCAN_COL_1          0
-#define SCAN_COL_2          5
-#define SCAN_COL_3          2
-#define SCAN_COL_4          3
-#define SCAN_COL_5          4
-#define SCAN_COL_6          1
-#define SCAN_COL_7          6
+// row port pin of each C64 column line
+#define SCAN_COL_PIN_0      6
+#define SCAN_COL_PIN_1      7
+#define SCAN_COL_PIN_2      4
+#define SCAN_COL_PIN_3      1
+#define SCAN_COL_PIN_4      2
+#define SCAN_COL_PIN_5      3
+#define SCAN_COL_PIN_6      0
+#define SCAN_COL_PIN_7      5
 
 #define KB_MAX_ROWS         8
 
+#ifdef KB_KLINE_MASK
+#  define KB_C128
+#elif defined CONFIG_KB_C128
+#  error "CONFIG_KB_C128 is not supported on this hardware."
+#endif
+
+#ifdef KB2_COL_IN
+#  define KB_DUAL
+#  ifdef KB_C128
+#    error "CONFIG_KB_DUAL and CONFIG_KB_C128 can't be used together."
+#  endif
+#elif defined CONFIG_KB_DUAL
+#  error "CONFIG_KB_DUAL is not supported on this hardware."
+#endif
+
+#ifdef JOY_PORTS
+#  define JOYSTICK
+#elif defined CONFIG_JOYSTICK
+#  error "CONFIG_JOYSTICK is not supported on this hardware."
+#endif
+
+#ifdef PET_SYNC_VECT
+#  define PET_SYNC
+#elif defined CONFIG_PET_SYNC
+#  error "CONFIG_PET_SYNC is not supported on this hardware."
+#else
+#  define pet_sync_init()   do {} while(0)
+#endif
 
-static inline void kb_set_row(uint8_t row) {
-  uint8_t tmp;
+// the columns read while row n is driven are stored as scan row n + 1
+#define KB_SCAN_IDX(row)    (((row) + 1) % KB_MAX_ROWS)
+
+#define SCAN_COL_0          KB_SCAN_IDX(SCAN_COL_PIN_0)
+#define SCAN_COL_1          KB_SCAN_IDX(SCAN_COL_PIN_1)
+#define SCAN_COL_2          KB_SCAN_IDX(SCAN_COL_PIN_2)
+#define SCAN_COL_3          KB_SCAN_IDX(SCAN_COL_PIN_3)
+#define SCAN_COL_4          KB_SCAN_IDX(SCAN_COL_PIN_4)
+#define SCAN_COL_5          KB_SCAN_IDX(SCAN_COL_PIN_5)
+#define SCAN_COL_6          KB_SCAN_IDX(SCAN_COL_PIN_6)
+#define SCAN_COL_7          KB_SCAN_IDX(SCAN_COL_PIN_7)
+
+#ifdef KB_C128
+// bit of each K line in the K line sample, see kb_read_col2()
+#  define SCAN_KLINE_0      0
+#  define SCAN_KLINE_1      1
+#  define SCAN_KLINE_2      2
+#endif
 
-  tmp = _BV(row);
-  KB_ROW_LO_DDR = tmp;          // bring DDR high on the one row
-  KB_ROW_LO_OUT = (uint8_t)~tmp;// bring others to pullups.
+#ifdef CONFIG_KB_DEBOUNCE
+#  define KB_DEBOUNCE_DEPTH CONFIG_KB_DEBOUNCE
+#endif
+
+#ifdef CONFIG_KB_GHOST_FILTER
+#  define KB_GHOST_FILTER
+#endif
+
+#ifdef CONFIG_KB_IDLE_TIMEOUT
+#  define KB_IDLE_TIMEOUT   CONFIG_KB_IDLE_TIMEOUT
+#endif
+
+#ifdef CONFIG_KB_FAST_ISR
+#  define KB_FAST_ISR
+#endif
+
+#ifdef CONFIG_ISR_TIMING
+#  ifdef CYCLE_COUNTER
+#    define ISR_TIMING
+#  else
+#    error "CONFIG_ISR_TIMING is not supported on this hardware."
+#  endif
+#endif
+
+
+// drive the lo bits low, all other row lines to pullups
+static inline void kb_drive_row(uint8_t lo) {
+  KB_ROW_LO_DDR = lo;           // bring DDR high on the one row
+  KB_ROW_LO_OUT = (uint8_t)~lo; // bring others to pullups.
+#ifdef KB2_ROW_DDR
+  // keyboard 2 scans the same row at the same time
+  KB2_ROW_DDR = lo;
+  KB2_ROW_OUT = (uint8_t)~lo;
+#endif
 }
 
 static inline uint8_t kb_read_col(void) {
   return (uint8_t) ~KB_COL_IN;
 }
 
+#ifdef KB2_COL_IN
+static inline uint8_t kb_read_col2(void) {
+  return (uint8_t) ~KB2_COL_IN;
+}
+#endif
+
+// with every row port line driven low, non-zero if any key is down
+static inline uint8_t kb_read_any(void) {
+#if defined KB_KLINE_MASK || defined KB2_COL_IN
+  return kb_read_col() | kb_read_col2();
+#else
+  return kb_read_col();
+#endif
+}
+
 #include "version.h"
 
 #define STRINGIFY(x) #x
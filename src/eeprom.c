@@ -23,13 +23,67 @@
 #include "config.h"
 #include "eeprom.h"
 
+#define EE_MAX_CONFIG_SIZE  128
+
+typedef struct {
+  uint8_t  dummy;       // the first byte is not used, brown-outs hit it.
+  uint8_t  checksum;    // sum of the structsize and cfg bytes
+  uint16_t structsize;  // sizeof(config_t) of the build that wrote it
+  config_t cfg;
+} storedconfig_t;
+
+static EEMEM storedconfig_t storedconfig;
+
 void update_eeprom(void* address,uint8_t data) {
   uint8_t tmp;
   
   while(!eeprom_is_ready());
   tmp=eeprom_read_byte(address);
-  if(tmp!=data)
-  while(!eeprom_is_ready());
-  eeprom_write_byte(address,data);
+  if(tmp!=data) {
+    while(!eeprom_is_ready());
+    eeprom_write_byte(address,data);
+  }
+}
+
+static uint8_t size_sum(uint16_t size) {
+  return (uint8_t)(size & 0xff) + (uint8_t)(size >> 8);
+}
+
+/*
+ * Load the stored settings into cfg.  Returns FALSE and leaves cfg alone
+ * if the EEPROM is blank or corrupt.
+ */
+uint8_t read_configuration(config_t *cfg) {
+  uint16_t size;
+  uint16_t i;
+  uint8_t sum;
+
+  size = eeprom_read_word(&storedconfig.structsize);
+  if(size > EE_MAX_CONFIG_SIZE)   // blank EEPROM reads 0xffff
+    return FALSE;
+  sum = size_sum(size);
+  for(i = 0; i < size; i++)
+    sum += eeprom_read_byte((uint8_t *)&storedconfig.cfg + i);
+  if(sum != eeprom_read_byte(&storedconfig.checksum))
+    return FALSE;
+  // a newer build may have stored more fields than this one knows.
+  eeprom_read_block(cfg, &storedconfig.cfg,
+                    (size < sizeof(config_t) ? size : sizeof(config_t)));
+  return TRUE;
+}
+
+void write_configuration(config_t *cfg) {
+  uint8_t i;
+  uint8_t *p = (uint8_t *)cfg;
+  uint8_t sum = size_sum(sizeof(config_t));
+
+  // the checksum goes last, so an interrupted write reads back as corrupt.
+  for(i = 0; i < sizeof(config_t); i++) {
+    update_eeprom((uint8_t *)&storedconfig.cfg + i, p[i]);
+    sum += p[i];
+  }
+  update_eeprom((uint8_t *)&storedconfig.structsize, sizeof(config_t) & 0xff);
+  update_eeprom((uint8_t *)&storedconfig.structsize + 1, sizeof(config_t) >> 8);
+  update_eeprom(&storedconfig.checksum, sum);
 }
 
@@ -21,6 +21,20 @@
 #ifndef EEPROM_H
 #define EEPROM_H
 
+/*
+ * Settings kept in EEPROM.  Only append new fields: an image written by
+ * an older build loads the fields it has and leaves the rest as they were.
+ */
+typedef struct {
+  uint8_t repeat_rate;      // 0 = off, else 1-9
+  uint8_t repeat_delay;     // 1-9, in 100 ms
+  uint8_t joy_keys[2][6];   // scan code per joystick line, 0xff = none
+  uint8_t autofire[2];      // per joystick, 0 = off, else rate 1-9
+  uint8_t pace;             // PET output pacing profile, 0-3
+} config_t;
+
 void update_eeprom(void* address,uint8_t data);
+uint8_t read_configuration(config_t *cfg);
+void write_configuration(config_t *cfg);
 
 #endif /*EEPROM_H*/
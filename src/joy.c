@@ -0,0 +1,155 @@
+/*
+ *  PETKey - VIC/64 to PET keyboard adapter
+ *  Copyright (C) 2021 Jim Brain and RETRO Innovations <go4retro@go4retro.com>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; version 2 of the License only.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ *  joy.c: Joystick ports, mapped straight onto the crosspoint
+ *
+ *  The ports are sampled on every scan tick and each closed line closes
+ *  the PET switch mapped to it, from the scan interrupt.  Joystick input
+ *  never goes through the key queue or the main loop translation.  The
+ *  switches are held with xptq_hold(), apart from the keyboard's, so key
+ *  releases and release all leave them closed.
+ *
+ *  Autofire pulses the fire switches while fire is held, counted in scan
+ *  ticks, so its period follows the timer whatever the main loop does.
+ */
+
+#include <avr/io.h>
+#include <inttypes.h>
+#include <util/atomic.h>
+
+#include "config.h"
+#include "kb.h"
+#include "joy.h"
+#include "xptq.h"
+
+#ifdef JOYSTICK
+
+static uint8_t joy_map[JOY_PORTS][JOY_LINES];   // PET switch per line
+static uint8_t joy_in[JOY_PORTS];               // debounced, 1 = closed
+static uint8_t joy_state[JOY_PORTS];            // lines closing their switch
+static uint8_t joy_last[JOY_PORTS];             // previous raw sample
+static uint8_t joy_rate[JOY_PORTS];             // autofire half period, 0 = off
+static uint8_t joy_count[JOY_PORTS];            // ticks left in this half
+static uint8_t joy_gap[JOY_PORTS];              // TRUE in the released half
+
+// TRUE if another closed line is mapped to the same switch
+static uint8_t joy_shared(uint8_t port, uint8_t line, uint8_t sw) {
+  uint8_t p, l;
+
+  for(p = 0; p < JOY_PORTS; p++) {
+    for(l = 0; l < JOY_LINES; l++) {
+      if((p != port || l != line)
+         && (joy_state[p] & _BV(l))
+         && joy_map[p][l] == sw
+        )
+        return TRUE;
+    }
+  }
+  return FALSE;
+}
+
+// joy_state must already hold the line's new state
+static void joy_switch(uint8_t port, uint8_t line, uint8_t state) {
+  uint8_t sw = joy_map[port][line];
+
+  if(sw != JOY_NO_SWITCH && !joy_shared(port, line, sw))
+    xptq_hold(sw, state);
+}
+
+void joy_set_map(uint8_t port, uint8_t line, uint8_t sw) {
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+    if(joy_state[port] & _BV(line)) {
+      // move a held line over to its new switch
+      joy_switch(port, line, FALSE);
+      joy_map[port][line] = sw;
+      joy_switch(port, line, TRUE);
+    } else {
+      joy_map[port][line] = sw;
+    }
+  }
+}
+
+/*
+ * hz = 0 turns autofire off.  Each half period lasts at least min_ticks,
+ * so a shot is held long enough for a PET scan to see it, and fast rates
+ * run slower than asked.
+ */
+void joy_set_autofire(uint8_t port, uint8_t hz, uint16_t min_ticks) {
+  uint16_t half;
+  uint8_t ticks = 0;
+
+  if(hz) {
+    half = SCAN_RATE / 2 / hz;
+    if(half < min_ticks)
+      half = min_ticks;
+    ticks = (half < 0xff ? half : 0xff);
+  }
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+    joy_rate[port] = ticks;
+    joy_count[port] = ticks;
+    joy_gap[port] = FALSE;
+  }
+}
+
+// called from the scan interrupt, every scan tick
+void joy_scan(void) {
+  uint8_t port, line;
+  uint8_t in, next, chg;
+
+  for(port = 0; port < JOY_PORTS; port++) {
+    in = joy_read(port);
+    // a press counts at once, a release must show in two samples running
+    next = in | (joy_in[port] & joy_last[port]);
+    joy_last[port] = in;
+    if(joy_rate[port] && (next & JOY_FIRE)) {
+      if(!(joy_in[port] & JOY_FIRE)) {
+        // fire just pressed, it shoots straight away
+        joy_count[port] = joy_rate[port];
+        joy_gap[port] = FALSE;
+      } else if(!--joy_count[port]) {
+        joy_count[port] = joy_rate[port];
+        joy_gap[port] = !joy_gap[port];
+      }
+    }
+    joy_in[port] = next;
+    if(joy_rate[port] && joy_gap[port])
+      next &= (uint8_t)~JOY_FIRE;
+    chg = next ^ joy_state[port];
+    // one line at a time, so joy_shared() sees the lines already handled
+    for(line = 0; chg; line++, chg >>= 1) {
+      if(chg & 1) {
+        joy_state[port] ^= _BV(line);
+        joy_switch(port, line, next & _BV(line));
+      }
+    }
+    // keep the scan timer at full rate while a line is closed
+    if(joy_in[port])
+      kb_keep_awake();
+  }
+}
+
+void joy_init(void) {
+  uint8_t port, line;
+
+  for(port = 0; port < JOY_PORTS; port++) {
+    for(line = 0; line < JOY_LINES; line++)
+      joy_map[port][line] = JOY_NO_SWITCH;
+  }
+  joy_init_ports();
+}
+
+#endif
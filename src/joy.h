@@ -0,0 +1,40 @@
+/*
+ *  PETKey - VIC/64 to PET keyboard adapter
+ *  Copyright (C) 2021 Jim Brain and RETRO Innovations <go4retro@go4retro.com>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; version 2 of the License only.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ *  joy.h: Definitions for the joystick ports
+ */
+
+#ifndef JOY_H
+#define JOY_H
+
+#define JOY_LINES             6      /* up, down, left, right, fire 1, fire 2 */
+#define JOY_NO_SWITCH         0xff
+#define JOY_FIRE              0x30   /* fire 1 and fire 2 lines */
+
+#ifdef JOYSTICK
+void joy_init(void);
+void joy_set_map(uint8_t port, uint8_t line, uint8_t sw);
+void joy_set_autofire(uint8_t port, uint8_t hz, uint16_t min_ticks);
+void joy_scan(void);
+#else
+#  define joy_init()          do {} while(0)
+#  define joy_set_map(p,l,s)  do {} while(0)
+#  define joy_set_autofire(p,h,m) do {} while(0)
+#  define joy_scan()          do {} while(0)
+#endif
+
+#endif
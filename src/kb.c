@@ -19,43 +19,171 @@
  */
 
 #include <avr/io.h>
+#include <avr/interrupt.h>
+#include <avr/cpufunc.h>
+#include <avr/pgmspace.h>
 #include <inttypes.h>
+#include <util/atomic.h>
 #include "config.h"
+#include "ring.h"
 #include "kb.h"
 
-static uint8_t          kb_rxbuf[KB_RX_BUFFER_SIZE];
-static volatile uint8_t kb_rxhead;
-static volatile uint8_t kb_rxtail;
+RING_DEFINE(kb_ring, kb_event_t, KB_RX_BUFFER_SHIFT)
 
-static uint8_t          kb_save[16];
+static kb_ring_t        kb_rx;
+
+// one slot per row and keyboard, keyboard 2 after keyboard 1
+static uint8_t          kb_save[KB_SLOTS];
+static uint8_t          kb_matrix[KB_SLOTS];
+// published copy of kb_save; readers use kb_snap[kb_snap_seq & 1]
+static kb_matrix_t      kb_snap[2];
+static volatile uint8_t kb_snap_seq;
+#ifdef KB_FAST_ISR
+// hot scan state lives in the I/O space: IN/OUT, 1 cycle, no pointer setup
+#  define kb_state      GPIOR0
+#  define kb_scan_idx   GPIOR1
+#  define kb_curr_value GPIOR2
+// keep the whole scan path in the ISR, so no call-clobbered register saves
+#  define KB_HOT        static inline __attribute__((always_inline))
+#else
 static volatile uint8_t kb_state;
 static volatile uint8_t kb_scan_idx;
+#  define KB_HOT        static
+#endif
+
+// row drive table: the row port bit to pull low, per scan row
+static const uint8_t    kb_rows[KB_MAX_ROWS] PROGMEM = {
+                                                        _BV(0), _BV(1),
+                                                        _BV(2), _BV(3),
+                                                        _BV(4), _BV(5),
+                                                        _BV(6), _BV(7)
+                                                       };
+
+#define kb_set_row(row)     kb_drive_row(pgm_read_byte(&kb_rows[row]))
+
+#ifdef KB_C128
+// the K lines of a row count as more columns of it for ghosting
+typedef uint16_t        kb_sense_t;
+#  define kb_sense(m, j)    ((m)[j] | (kb_sense_t)(m)[(j) + KB_MAX_ROWS] << 8)
+#else
+typedef uint8_t         kb_sense_t;
+#  define kb_sense(m, j)    ((m)[j])
+#endif
+
+#ifdef KB_DEBOUNCE_DEPTH
+#  if KB_DEBOUNCE_DEPTH < 1 || KB_DEBOUNCE_DEPTH > 8
+#    error KB_DEBOUNCE_DEPTH must be between 1 and 8
+#  endif
+// vertical counters, one byte per counter bit per row.
+static uint8_t          kb_db_ct0[KB_SLOTS];
+static uint8_t          kb_db_ct1[KB_SLOTS];
+#  if KB_DEBOUNCE_DEPTH > 4
+static uint8_t          kb_db_ct2[KB_SLOTS];
+#  endif
+
+// select counter bit or its inverse to compare counters against depth - 1
+#  define KB_DB_CMP(ct, bit)  (((KB_DEBOUNCE_DEPTH - 1) & (bit)) ? (ct) : (uint8_t)~(ct))
+#endif
 
-#ifdef KB_SCAN_PORTS
-static uint8_t          kb_port_save[2];
+#ifdef KB_GHOST_FILTER
+// ghost rows per keyboard: this pass so far, the last pass, the one before
+static uint8_t          kb_ghost_acc[KB_SOURCES];
+static uint8_t          kb_ghost[KB_SOURCES];
+static uint8_t          kb_ghost_prev[KB_SOURCES];
+static volatile uint16_t kb_ghost_count;
+#endif
+
+#ifdef KB_IDLE_PASSES
+static uint16_t         kb_idle_count;
+static uint8_t          kb_wake_timing;
+static uint16_t         kb_wake_ts;
+static volatile uint8_t kb_wake_latency = KB_NO_LATENCY;
 #endif
 
 static volatile uint8_t  kb_repeat_code;
 static volatile uint16_t kb_repeat_count;
 static volatile uint16_t kb_repeat_delay;
 static volatile uint16_t kb_repeat_period;
+#ifndef KB_FAST_ISR
 static volatile uint8_t  kb_curr_value;
+#endif
+#if KB_SAMPLES > 1
+static uint8_t           kb_curr_value2;  // second sample, read with kb_curr_value
+#endif
+static volatile uint16_t kb_ticks;
+
+KB_HOT void kb_store(uint8_t data) {
+  kb_event_t ev;
+#ifdef KB_IDLE_PASSES
+  uint16_t tmpts;
+#endif
+
+  ev.code = data;
+  ev.ts = kb_ticks;
+  kb_ring_put(&kb_rx, ev);  // a full queue counts the drop.
+#ifdef KB_IDLE_PASSES
+  if(kb_wake_timing) {
+    tmpts = ev.ts - kb_wake_ts;
+    kb_wake_latency = (tmpts < KB_NO_LATENCY ? tmpts : KB_NO_LATENCY - 1);
+    kb_wake_timing = FALSE;
+  }
+#endif
+}
 
-static void kb_store(uint8_t data) {
-  uint8_t tmphead;
-  
-  tmphead = (kb_rxhead + 1) & KB_RX_BUFFER_MASK;
-  kb_rxhead = tmphead;      /* Store new index */
+#ifdef KB_DEBOUNCE_DEPTH
+static inline uint8_t kb_debounce(uint8_t in, uint8_t j) {
+  uint8_t c0, c1, delta, hit;
+#  if KB_DEBOUNCE_DEPTH > 4
+  uint8_t c2;
+#  endif
 
-  //if ( tmphead == kb_rxtail ) {
-    /* ERROR! Receive buffer overflow */
-  //}
-  
-  kb_rxbuf[tmphead] = data; /* Store received data in buffer */
+  /*
+    Each column of the row has its own counter, stored vertically:
+    bit n of kb_db_ct0[j] is bit 0 of the counter for column n, etc.
+    A column that reads different from the debounced state counts up,
+    one that reads the same is reset to 0.  When a differing column has
+    already counted to depth - 1, the change is accepted.
+  */
+  c0 = kb_db_ct0[j];
+  c1 = kb_db_ct1[j];
+  delta = in ^ kb_matrix[j];
+  hit = delta & KB_DB_CMP(c0, 1) & KB_DB_CMP(c1, 2);
+#  if KB_DEBOUNCE_DEPTH > 4
+  c2 = kb_db_ct2[j];
+  hit &= KB_DB_CMP(c2, 4);
+#  endif
+  delta &= ~hit;  // accepted columns reset their counters, too.
+#  if KB_DEBOUNCE_DEPTH > 4
+  kb_db_ct2[j] = (c2 ^ (c1 & c0)) & delta;
+#  endif
+  kb_db_ct1[j] = (c1 ^ c0) & delta;
+  kb_db_ct0[j] = ~c0 & delta;
+  return kb_matrix[j] ^ hit;
 }
+#endif
 
-static void kb_decode(uint8_t new, uint8_t *old, uint8_t base) {
-  uint8_t i, mask, result;
+// index of the lowest set bit in each byte value
+static const uint8_t kb_bit_pos[256] PROGMEM = {
+  0, 0, 1, 0, 2, 0, 1, 0, 3, 0, 1, 0, 2, 0, 1, 0,
+  4, 0, 1, 0, 2, 0, 1, 0, 3, 0, 1, 0, 2, 0, 1, 0,
+  5, 0, 1, 0, 2, 0, 1, 0, 3, 0, 1, 0, 2, 0, 1, 0,
+  4, 0, 1, 0, 2, 0, 1, 0, 3, 0, 1, 0, 2, 0, 1, 0,
+  6, 0, 1, 0, 2, 0, 1, 0, 3, 0, 1, 0, 2, 0, 1, 0,
+  4, 0, 1, 0, 2, 0, 1, 0, 3, 0, 1, 0, 2, 0, 1, 0,
+  5, 0, 1, 0, 2, 0, 1, 0, 3, 0, 1, 0, 2, 0, 1, 0,
+  4, 0, 1, 0, 2, 0, 1, 0, 3, 0, 1, 0, 2, 0, 1, 0,
+  7, 0, 1, 0, 2, 0, 1, 0, 3, 0, 1, 0, 2, 0, 1, 0,
+  4, 0, 1, 0, 2, 0, 1, 0, 3, 0, 1, 0, 2, 0, 1, 0,
+  5, 0, 1, 0, 2, 0, 1, 0, 3, 0, 1, 0, 2, 0, 1, 0,
+  4, 0, 1, 0, 2, 0, 1, 0, 3, 0, 1, 0, 2, 0, 1, 0,
+  6, 0, 1, 0, 2, 0, 1, 0, 3, 0, 1, 0, 2, 0, 1, 0,
+  4, 0, 1, 0, 2, 0, 1, 0, 3, 0, 1, 0, 2, 0, 1, 0,
+  5, 0, 1, 0, 2, 0, 1, 0, 3, 0, 1, 0, 2, 0, 1, 0,
+  4, 0, 1, 0, 2, 0, 1, 0, 3, 0, 1, 0, 2, 0, 1, 0
+};
+
+KB_HOT void kb_decode(uint8_t new, uint8_t *old, uint8_t base) {
+  uint8_t mask, result, code;
   // we have a key change.
   /*
     If old was:     00001010
@@ -65,56 +193,338 @@ static void kb_decode(uint8_t new, uint8_t *old, uint8_t base) {
     
     Then, new & xor gives us new keys
     and old and xor gives us keys no longer pressed.
+
+    Each loop pass reports the lowest set bit and clears it, so the cost
+    is per changed key, not per column.
   */
   mask = new ^ *old;
   result = (*old & mask);
-  i = 0;
   while(result) {
     // we have keys no longer pressed.
-    if(result & 1)
-      kb_store((base + i) | KB_KEY_UP);
-    result = result >> 1;
-    i++;
+    code = base + pgm_read_byte(&kb_bit_pos[result]);
+    // stop repeating here, so no repeat is queued behind the release.
+    if(code == kb_repeat_code)
+      kb_repeat_code = KB_NO_REPEAT;
+    kb_store(code | KB_KEY_UP);
+    result &= result - 1;
   }
   result=(new & mask);
-  i = 0;
   while(result) {
     // we have keys pressed.
+    kb_store(base + pgm_read_byte(&kb_bit_pos[result]));
+    result &= result - 1;
+  }
+  *old = new;
+}
+
+#ifdef CYCLE_COUNTER
+static volatile uint8_t kb_bench_sink;
+
+// the changed keys of a row, found with the shift loop kb_decode() used
+static void __attribute__((noinline)) kb_bench_loop(uint8_t result) {
+  uint8_t i = 0;
+
+  while(result) {
     if(result & 1)
-      kb_store(base + i);
+      kb_bench_sink = i;
     result = result >> 1;
     i++;
   }
-  *old = new;
 }
 
+// the same with kb_bit_pos, as kb_decode() finds them now
+static void __attribute__((noinline)) kb_bench_table(uint8_t result) {
+  while(result) {
+    kb_bench_sink = pgm_read_byte(&kb_bit_pos[result]);
+    result &= result - 1;
+  }
+}
+
+/*
+ * Time both ways of finding the changed keys over every possible change
+ * of a row, keys going to a dummy rather than the queue.  Fills in
+ * cycles[0] and [1], average and worst with the loop, and [2] and [3]
+ * with the table, call overhead included in both.  A clang 14 build in a
+ * cycle-counting simulator gives 109/125 for the loop and 87/151 for the
+ * table: the table costs 16 cycles a changed key, the loop 12 a bit up to
+ * the highest change, so the table only loses when most of a row changes
+ * in one pass.
+ */
+void kb_bench_decode(uint16_t *cycles) {
+  uint8_t i, j;
+  uint16_t t;
+  uint32_t sum;
+
+  for(j = 0; j < 2; j++) {
+    sum = 0;
+    cycles[j * 2 + 1] = 0;
+    i = 0;
+    do {
+      ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+        cycles_start();
+        if(j)
+          kb_bench_table(i);
+        else
+          kb_bench_loop(i);
+        t = cycles_stop();
+      }
+      sum += t;
+      if(t > cycles[j * 2 + 1])
+        cycles[j * 2 + 1] = t;
+    } while(++i);
+    cycles[j * 2] = sum / 256;
+  }
+}
+#endif
+
+#ifdef KB_GHOST_FILTER
+/*
+  Without diodes, holding 3 corners of a rectangle makes the 4th corner
+  read as pressed, too.  So any 2 rows that share 2 or more columns are
+  ambiguous.  Rows with fewer than 2 keys down can't be part of one.
+
+  The work is spread over the pass, so no one interrupt does all of it:
+  each row is compared to the rows read before it as it comes in, and
+  once a pass is complete, the next one decodes each of its rows just
+  before reading that row again.
+*/
+KB_HOT void kb_ghost_check(uint8_t j) {
+  uint8_t i, src, bit;
+  kb_sense_t in, hold;
+  uint8_t *matrix;
+
+  for(src = 0; src < KB_SOURCES; src++) {
+    matrix = &kb_matrix[src * KB_MAX_ROWS];
+    in = kb_sense(matrix, j);
+    if(!(in & (in - 1)))
+      continue;
+    bit = 1;
+    for(i = 0; i < j; i++) {
+      hold = in & kb_sense(matrix, i);
+      if(hold & (hold - 1))
+        kb_ghost_acc[src] |= bit | (uint8_t)(1 << j);
+      bit <<= 1;
+    }
+  }
+}
+
+// decode slot j, holding back its new presses if its row is ghosted.
+KB_HOT void kb_ghost_slot(uint8_t j, uint8_t ghost, uint8_t was) {
+  uint8_t in = kb_matrix[j];
+  uint8_t hold;
+
+  if(ghost) {
+    // releases are always real, but hold new presses on this row.
+    hold = in & ~kb_save[j];
+    in &= kb_save[j];
+    if(hold && !was)
+      kb_ghost_count++;
+  }
+  if(in != kb_save[j]) {
+    kb_decode(in, &kb_save[j], j << 3);
+  }
+}
+
+// decode row j of the last pass, before it is read again.
+KB_HOT void kb_ghost_decode(uint8_t j) {
+  uint8_t src, ghost, was;
+  uint8_t bit = 1 << j;
+
+  for(src = 0; src < KB_SOURCES; src++) {
+    ghost = kb_ghost[src] & bit;
+    was = kb_ghost_prev[src] & bit;
+    kb_ghost_slot(src * KB_MAX_ROWS + j, ghost, was);
+#ifdef KB_C128
+    kb_ghost_slot(KB_MAX_ROWS + j, ghost, was);
+#endif
+  }
+}
+
+// the pass is complete, its ghost rows hold while the next decodes it.
+KB_HOT void kb_ghost_pass(void) {
+  uint8_t src;
+
+  for(src = 0; src < KB_SOURCES; src++) {
+    kb_ghost_prev[src] = kb_ghost[src];
+    kb_ghost[src] = kb_ghost_acc[src];
+    kb_ghost_acc[src] = 0;
+  }
+}
+#endif
+
+#ifdef KB_IDLE_PASSES
+KB_HOT void kb_wake(void) {
+#  ifdef KB_COL_PCMSK
+  PCICR &= (uint8_t)~_BV(KB_COL_PCIE);
+#  endif
+  timer_set_active();
+  kb_curr_value = 0;
+  kb_scan_idx = 0;
+  kb_state = KB_ST_READ;
+  kb_wake_ts = kb_ticks;
+  kb_wake_timing = TRUE;
+}
+
+KB_HOT uint8_t kb_idle_check(void) {
+  uint8_t i;
+  uint8_t keys = 0;
+
+  // kb_save as well, so no change still waiting to be decoded is lost
+  for(i = 0; i < KB_SLOTS; i++)
+    keys |= kb_matrix[i] | kb_save[i];
+  if(keys || kb_repeat_code != KB_NO_REPEAT) {
+    kb_idle_count = 0;
+    return FALSE;
+  }
+  if(++kb_idle_count < KB_IDLE_PASSES)
+    return FALSE;
+  kb_idle_count = 0;
+  // with every row driven, any key pulls its column low.
+  kb_drive_row(0xff);
+  timer_set_idle();
+#  ifdef KB_COL_PCMSK
+  KB_COL_PCMSK = 0xff;
+  PCIFR = _BV(KB_COL_PCIE);
+  PCICR |= _BV(KB_COL_PCIE);
+#  endif
+  kb_state = KB_ST_IDLE;
+  return TRUE;
+}
+
+// for other inputs sampled on the scan timer, call from its interrupt.
+void kb_keep_awake(void) {
+  kb_idle_count = 0;
+  if(kb_state == KB_ST_IDLE) {
+    kb_wake();
+    kb_wake_timing = FALSE;     // not a key, nothing to time
+  }
+}
+
+#  ifdef KB_COL_PCMSK
+ISR(KB_COL_PCINT_vect) {
+  if(kb_state == KB_ST_IDLE)
+    kb_wake();
+}
+#  endif
+#endif
+
+KB_HOT void kb_repeat(void) {
+  uint8_t code = kb_repeat_code;
+
+  if(code != KB_NO_REPEAT) {
+    kb_repeat_count--;
+    if(!kb_repeat_count) {
+      kb_repeat_count = kb_repeat_period;
+      kb_store(code);
+    }
+  }
+}
+
+KB_HOT void kb_publish(void) {
+  uint8_t i;
+  kb_matrix_t *snap = &kb_snap[(kb_snap_seq + 1) & 1];
+
+  // fill the buffer readers are not using, then flip.
+  for(i = 0; i < KB_SLOTS; i++)
+    snap->rows[i] = kb_save[i];
+  _MemoryBarrier();
+  kb_snap_seq++;
+}
+
+KB_HOT void kb_read_slot(uint8_t in, uint8_t j) {
+#ifdef KB_DEBOUNCE_DEPTH
+  in = kb_debounce(in, j);
+#endif
+  kb_matrix[j] = in;
+#ifndef KB_GHOST_FILTER
+  if(in != kb_save[j]) {
+    kb_decode(in, &kb_save[j], j << 3);
+  }
+#endif
+}
+
+// returns TRUE if the scanner went idle after this row.
+KB_HOT uint8_t kb_read_row(uint8_t in, uint8_t j) {
+#ifdef KB_GHOST_FILTER
+  kb_ghost_decode(j);
+#endif
+  kb_read_slot(in, j);
+#if KB_SAMPLES > 1
+  kb_read_slot(kb_curr_value2, j + KB_MAX_ROWS);
+#endif
+#ifdef KB_GHOST_FILTER
+  kb_ghost_check(j);
+#endif
+  if(j == KB_MAX_ROWS - 1) {
+#ifdef KB_GHOST_FILTER
+    kb_ghost_pass();
+#endif
+    kb_publish();
+#ifdef KB_IDLE_PASSES
+    if(kb_idle_check())
+      return TRUE;
+#endif
+  }
+  return FALSE;
+}
+
+/*
+ * Scan interrupt work, per tick:
+ *   compare A, kb_scan(): tick count, repeat countdown, row drive, or
+ *     in idle, one port read.
+ *   compare B, kb_sample(): one row read and debounced per sample
+ *     (keyboard 2 or the K lines are a second sample), with the ghost
+ *     filter compared against the rows read before it, and the same row
+ *     of the last pass decoded.  So one tick reports at most the 8 keys
+ *     of a row per sample, not the whole matrix.
+ *   end of pass, in the row 7 sample: snapshot publish and idle check,
+ *     a copy and an OR over KB_SLOTS bytes.
+ * The two-phase scan (no KB_FAST_SCAN) does the compare B work in
+ * KB_ST_READ and the row drive in KB_ST_PREP.
+ *
+ * Worst cycles with KB_FAST_ISR, entry and exit included, from the
+ * flattened interrupts of a clang 14 LTO build run in a cycle-counting
+ * simulator against a matrix model (avr-gcc code will differ somewhat):
+ *   compare A  KB_ST_IDLE poll              184
+ *              KB_ST_READ row drive         189, 250 storing a repeat
+ *              + joy_scan()                 up to 1330, all lines changing
+ *              + xptq_run()                 52, and ~190 per change sent
+ *   compare B  sample: read, debounce       217
+ *              + ghost compare and decode   up to 281, row 7
+ *              + kb_decode()                up to 646, a whole row
+ *              + pass end, row 7            198
+ *              whole interrupt              904 (row 0) to 1202 (row 7)
+ * On the target, CONFIG_ISR_TIMING cross-checks these: S in config mode
+ * reports the longest time the main loop was held off by an interrupt.
+ * Recheck after changing this path.
+ */
 void kb_scan(void) {
   // this should be called 120 * rows times/sec
+#ifndef KB_FAST_SCAN
   uint8_t j;
-  uint8_t in;
+#endif
   // this is where we scan.
   // we scan at 120Hz
+#ifdef KB_IDLE_PASSES
+  if(kb_state == KB_ST_IDLE) {
+    kb_ticks += KB_IDLE_TICKS;
+  } else
+#endif
+  {
+    kb_ticks++;
+    // repeat timing is in scan ticks, SCAN_RATE per second.
+    kb_repeat();
+  }
   switch(kb_state) {
     default:
     case KB_ST_READ:
-      in = kb_repeat_code;
-      if(in != KB_NO_REPEAT) {
-        kb_repeat_count--;
-        if(!kb_repeat_count) {
-          kb_repeat_count = kb_repeat_period;
-          kb_store(in);
-        }
-      }
-      in = kb_curr_value;
-      j = kb_scan_idx;
-#ifdef KB_SCAN_PORTS
-      // we broght lines hi, so check for port action.  If we have it, then discard character.
-      if(KB_ROW_LO_IN == 0xff && KB_COL_IN == 0xff && in != kb_save[j]) {
+#ifdef KB_FAST_SCAN
+      // kb_sample() reads the columns once the row has settled.
+      kb_set_row(kb_scan_idx);
 #else
-      if(in != kb_save[j]) {
-#endif
-        kb_decode(in, &kb_save[j], j << 3);
-      }
+      j = kb_scan_idx;
+      if(kb_read_row(kb_curr_value, j))
+        break;
       // we just read, prep now.
       kb_set_row(j);
       j++;
@@ -122,65 +532,91 @@ void kb_scan(void) {
         j = 0;
       kb_scan_idx = j;
       kb_state = KB_ST_PREP;
+#endif
       break;
+#ifndef KB_FAST_SCAN
     case KB_ST_PREP:
       // we just prepped, read.
       kb_curr_value = kb_read_col();
+#if KB_SAMPLES > 1
+      kb_curr_value2 = kb_read_col2();
+#endif
       kb_state = KB_ST_READ;
-#ifdef KB_SCAN_PORTS
-      // set rows back to input.
-      KB_ROW_LO_DDR = 0;
-      KB_ROW_HI_DDR = 0;
-      KB_ROW_LO_OUT = 0xff;
-      KB_ROW_HI_OUT = 0xff;
-      j = kb_scan_idx;
-      if(j == 0) {
-        kb_state = KB_ST_READ_PORTS;
-      }
       break;
-    case KB_ST_READ_PORTS:
-      // read the two ports directly
-      in = (uint8_t)~KB_ROW_LO_IN;
-      if(in != kb_port_save[1]) {
-        kb_decode(in, &kb_port_save[1], 0x78);
-      }
-      in = (uint8_t)~KB_COL_IN;
-      if(in != kb_port_save[0]) {
-        kb_decode(in, &kb_port_save[0], 0x70);
-      }
-      kb_state = KB_ST_READ;
 #endif
+#ifdef KB_IDLE_PASSES
+    case KB_ST_IDLE:
+      if(kb_read_any()) {
+        kb_wake();
+        // the key went down some time since the last poll, time from it
+        kb_wake_ts -= KB_IDLE_TICKS;
+      }
       break;
+#endif
   }
 }
 
+#ifdef KB_FAST_SCAN
+void kb_sample(void) {
+  uint8_t j;
+  uint8_t in;
+
+  if(kb_state != KB_ST_READ)
+    return;
+  in = kb_read_col();
+#if KB_SAMPLES > 1
+  kb_curr_value2 = kb_read_col2();
+#endif
+  // as in the two-phase scan, the columns read while row n is driven
+  // are stored as scan row n + 1.
+  j = kb_scan_idx + 1;
+  if(j == KB_MAX_ROWS)
+    j = 0;
+  kb_scan_idx = j;
+  kb_read_row(in, j);
+}
+#endif
+
 void kb_init() {
+  kb_ring_init(&kb_rx);
   kb_state = KB_ST_READ;
   kb_repeat_code = KB_NO_REPEAT;  // set keyboard repeat to 0.
-  kb_set_repeat_delay(250);       // wait 250 ms
-  kb_set_repeat_period(32);       // once every 32 ms
+  kb_set_repeat_delay(500);       // wait 500 ms
+  kb_set_repeat_period(100);      // once every 100 ms
 
-#ifdef KB_SCAN_PORTS  
-  KB_ROW_LO_OUT = 0xff;
-  KB_ROW_HI_OUT = 0xff;
-#endif
   KB_COL_OUT = 0xff;         // turn on pullups.
+#if KB_SAMPLES > 1
+  kb2_init();
+#endif
 }
 
 void kb_set_repeat_delay(uint16_t ms) {
-  // 1800 ticks/sec, .5 ms per tick.
-  kb_repeat_delay = (ms << 1);
-  kb_repeat_count = kb_repeat_delay;
+  uint16_t ticks = KB_MS_TO_TICKS(ms);
+
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+    kb_repeat_delay = (ticks ? ticks : 1);
+    kb_repeat_count = kb_repeat_delay;
+  }
 }
 
-void kb_set_repeat_period(uint16_t period) {
-  kb_repeat_period = (period << 1);
+void kb_set_repeat_period(uint16_t ms) {
+  uint16_t ticks = KB_MS_TO_TICKS(ms);
+
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+    kb_repeat_period = (ticks ? ticks : 1);
+  }
 }
 
+/*
+ * Repeat code as a key down event, first after the repeat delay, then
+ * every repeat period, until the key is released or another code is set.
+ */
 void kb_set_repeat_code(uint8_t code) {
-  if(code != kb_repeat_code) {
-    kb_repeat_count = kb_repeat_delay;
-    kb_repeat_code = code;
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+    if(code != kb_repeat_code) {
+      kb_repeat_count = kb_repeat_delay;
+      kb_repeat_code = code;
+    }
   }
 }
 
@@ -188,18 +624,83 @@ uint8_t kb_get_repeat_code() {
   return kb_repeat_code;
 }
 
+#ifdef KB_GHOST_FILTER
+uint16_t kb_get_ghost_count(void) {
+  uint16_t count;
+
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+    count = kb_ghost_count;
+  }
+  return count;
+}
+#endif
+
+#ifdef KB_IDLE_PASSES
+/*
+ * Milliseconds from a key going down in idle to its event, at worst: a
+ * polled wake counts from the poll before the one that saw the key, so
+ * the whole poll period is in the figure.
+ */
+uint8_t kb_get_wake_latency(void) {
+  uint8_t ticks = kb_wake_latency;
+  uint16_t ms;
+
+  if(ticks == KB_NO_LATENCY)
+    return KB_NO_LATENCY;
+  kb_wake_latency = KB_NO_LATENCY;
+  ms = KB_TICKS_TO_MS(ticks);
+  return (ms < KB_NO_LATENCY ? ms : KB_NO_LATENCY - 1);
+}
+#endif
+
 uint8_t kb_data_available(void) {
-  return ( kb_rxhead != kb_rxtail ); /* Return 0 (FALSE) if the receive buffer is empty */
+  return !kb_ring_empty(&kb_rx); /* Return 0 (FALSE) if the receive buffer is empty */
 }
 
 uint8_t kb_recv( void ) {
-	uint8_t tmptail;
-	
-	while (kb_rxhead == kb_rxtail);
-	tmptail = (kb_rxtail + 1) & KB_RX_BUFFER_MASK;/* Calculate buffer index */
-	
-	kb_rxtail = tmptail;                /* Store new index */
-	
-	return kb_rxbuf[tmptail];           /* Return data */
+  while (kb_ring_empty(&kb_rx));
+  return kb_ring_get(&kb_rx).code;
+}
+
+uint8_t kb_recv_ts(uint16_t *ts) {
+  kb_event_t ev;
+
+  while (kb_ring_empty(&kb_rx));
+  ev = kb_ring_get(&kb_rx);
+  *ts = ev.ts;
+  return ev.code;
+}
+
+uint8_t kb_get_rx_hiwater(void) {
+  return kb_ring_hiwater(&kb_rx);
+}
+
+uint16_t kb_get_rx_drops(void) {
+  return kb_ring_drops(&kb_rx);
+}
+
+/*
+ * Copies the key state as of the last complete matrix pass.  The scanner
+ * only ever writes the other buffer, so the copy is retried only if a
+ * pass completes while it is being made.  Returns the pass count.
+ */
+uint8_t kb_get_matrix(kb_matrix_t *matrix) {
+  uint8_t seq;
+
+  do {
+    seq = kb_snap_seq;
+    *matrix = kb_snap[seq & 1];
+    _MemoryBarrier();
+  } while(seq != kb_snap_seq);
+  return seq;
+}
+
+uint16_t kb_get_ticks(void) {
+  uint16_t ticks;
+
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+    ticks = kb_ticks;
+  }
+  return ticks;
 }
 
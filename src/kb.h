@@ -23,27 +23,95 @@
 
 #define KB_ST_PREP            1
 #define KB_ST_READ            2
-#define KB_ST_READ_PORTS      3
+#define KB_ST_IDLE            4
+
+#ifdef KB_FAST_SCAN
+#  define KB_TICKS_PER_ROW    1
+#else
+#  define KB_TICKS_PER_ROW    2
+#endif
+
+#ifdef KB_IDLE_TIMEOUT
+// number of empty matrix passes before going idle
+#  define KB_IDLE_PASSES      ((uint16_t)((uint32_t)KB_IDLE_TIMEOUT * SCAN_RATE \
+                                           / (1000UL * KB_TICKS_PER_ROW * KB_MAX_ROWS)))
+#  define KB_NO_LATENCY       0xff
+// approximate scan ticks per idle timer period (/1024, OCR0A = 255)
+#  define KB_IDLE_TICKS       ((uint16_t)(256UL * 1024 * SCAN_RATE / F_CPU))
+#endif
+
+// convert scan ticks from kb_get_ticks()/kb_recv_ts() to milliseconds
+#define KB_TICKS_TO_MS(t)     ((uint16_t)(((uint32_t)(t) * 1000) / SCAN_RATE))
+#define KB_MS_TO_TICKS(ms)    ((uint16_t)(((uint32_t)(ms) * SCAN_RATE) / 1000))
+// at least ms, for times the PET must not miss
+#define KB_MS_TO_TICKS_UP(ms) ((uint16_t)(((uint32_t)(ms) * SCAN_RATE + 999) / 1000))
 
 #define KB_KEY_UP             0x80
 #define KB_SCAN_CODE_MASK     ~KB_KEY_UP
 
-#define KB_NO_REPEAT          0xff
+#ifdef KB_DUAL
+#  define KB_SOURCES          2
+// codes from keyboard 2 have this bit set, they follow keyboard 1's rows
+#  define KB_SRC_MASK         (KB_MAX_ROWS << 3)
+#else
+#  define KB_SOURCES          1
+#  define KB_SRC_MASK         0
+#endif
+#define KB_SRC(code)          (((code) & KB_SRC_MASK) ? 1 : 0)
 
-#define KB_RX_BUFFER_SIZE     16     /* 2,4,8,16,32,64,128 or 256 bytes */
-#define KB_RX_BUFFER_MASK     (KB_RX_BUFFER_SIZE - 1)
-#if (KB_RX_BUFFER_SIZE & KB_RX_BUFFER_MASK)
-#  error KB RX buffer size is not a power of 2
+#if defined KB_DUAL || defined KB_C128
+// a second byte is read with each row: keyboard 2's columns or the K lines
+#  define KB_SAMPLES          2
+#else
+#  define KB_SAMPLES          1
 #endif
+// matrix slots, one per row and sample, second samples after the first
+#define KB_SLOTS              (KB_MAX_ROWS * KB_SAMPLES)
+
+#ifdef KB_C128
+// K line keys follow the row port keys
+#  define KB_CODES            (KB_SLOTS * 8)
+#else
+// keyboard 2 codes map as keyboard 1's, less KB_SRC_MASK
+#  define KB_CODES            (KB_MAX_ROWS * 8)
+#endif
+
+#define KB_NO_REPEAT          0xff
+
+#define KB_RX_BUFFER_SHIFT    6      /* log2 of the event queue size, 1-8 */
+
+typedef struct {
+  uint8_t  code;
+  uint16_t ts;
+} kb_event_t;
+
+// key state as of the end of a matrix pass, 1 = key down
+typedef struct {
+  uint8_t  rows[KB_SLOTS];
+} kb_matrix_t;
 
 void kb_init(void);
 void kb_set_repeat_delay(uint16_t ms);
-void kb_set_repeat_period(uint16_t period);
+void kb_set_repeat_period(uint16_t ms);
 void kb_set_repeat_code(uint8_t code);
 uint8_t kb_get_repeat_code(void);
+uint16_t kb_get_ghost_count(void);
+uint8_t kb_get_wake_latency(void);
+#ifdef KB_IDLE_PASSES
+void kb_keep_awake(void);
+#else
+#  define kb_keep_awake()     do {} while(0)
+#endif
 uint8_t kb_data_available( void );
 uint8_t kb_recv( void );
+uint8_t kb_recv_ts(uint16_t *ts);
+uint16_t kb_get_ticks(void);
+uint8_t kb_get_matrix(kb_matrix_t *matrix);
+uint8_t kb_get_rx_hiwater(void);
+uint16_t kb_get_rx_drops(void);
+void kb_bench_decode(uint16_t *cycles);
 void kb_scan(void);
+void kb_sample(void);
 
 #endif
 
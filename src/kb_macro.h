@@ -10,6 +10,8 @@
 
 //#ifdef __AVR_ATmega162__ ||
 #define MACRO_SZ 500
+// longest single macro, in PET keys
+#define MACRO_LEN_MAX 64
 
 typedef enum {
   KBMRES_SUCCESS = 0,
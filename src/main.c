@@ -25,13 +25,45 @@
 #include "config.h"
 
 #include "debug.h"
+#include "joy.h"
+#include "kb.h"
 #include "uart.h"
 #include "vkb.h"
+#include "xptq.h"
 
+#ifdef KB_FAST_ISR
+// go straight to the scanner, skipping the vkb layer.  flatten inlines the
+// whole call tree, across files with -flto, so no call-clobbered registers
+// are saved for calls.
+ISR(SCAN_TIMER, __attribute__((flatten))) {
+  kb_scan();
+  joy_scan();
+  xptq_run();
+}
+
+#  ifdef SCAN_SAMPLE_TIMER
+ISR(SCAN_SAMPLE_TIMER, __attribute__((flatten))) {
+  kb_sample();
+}
+#  endif
+#else
 ISR(SCAN_TIMER) {
   vkb_irq();
 }
 
+#  ifdef SCAN_SAMPLE_TIMER
+ISR(SCAN_SAMPLE_TIMER) {
+  vkb_irq_sample();
+}
+#  endif
+#endif
+
+#ifdef PET_SYNC
+ISR(PET_SYNC_VECT) {
+  xptq_sync();
+}
+#endif
+
 void main( void ) {
   debug_init();
   timer_init();
@@ -0,0 +1,152 @@
+/*
+ *  PETKey - VIC/64 to PET keyboard adapter
+ *  Copyright (C) 2021 Jim Brain and RETRO Innovations <go4retro@go4retro.com>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; version 2 of the License only.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ *  ring.h: Single producer/single consumer ring buffers
+ *
+ *  RING_DEFINE(name, type, shift) generates name_t, holding 2^shift
+ *  elements of type (one slot is kept free), and static inline
+ *  name_xxx() functions to operate on it.  One side may run in an ISR and
+ *  the other in the main loop without disabling interrupts: the producer
+ *  only writes head, the consumer only writes tail.  A full ring drops
+ *  the new element and counts it; it never overwrites unread data.
+ */
+
+#ifndef RING_H
+#define RING_H
+
+#include <inttypes.h>
+#include <util/atomic.h>
+
+// keep buffer accesses on the right side of the index update
+#define RING_BARRIER()    __asm__ __volatile__ ("" ::: "memory")
+
+#define RING_DEFINE(name, type, shift)                                       \
+                                                                             \
+typedef struct {                                                             \
+  type              buf[1 << (shift)];                                       \
+  volatile uint8_t  head;     /* next slot to fill, producer only */         \
+  volatile uint8_t  tail;     /* next slot to read, consumer only */         \
+  uint8_t           hiwater;  /* most elements ever queued */                \
+  volatile uint16_t drops;    /* elements lost to a full ring */             \
+} name##_t;                                                                  \
+                                                                             \
+static inline void name##_init(name##_t *r) {                                \
+  r->head = 0;                                                               \
+  r->tail = 0;                                                               \
+  r->hiwater = 0;                                                            \
+  r->drops = 0;                                                              \
+}                                                                            \
+                                                                             \
+static inline uint8_t name##_count(name##_t *r) {                            \
+  return (uint8_t)(r->head - r->tail) & ((1 << (shift)) - 1);                \
+}                                                                            \
+                                                                             \
+static inline uint8_t name##_free(name##_t *r) {                             \
+  return ((1 << (shift)) - 1) - name##_count(r);                             \
+}                                                                            \
+                                                                             \
+static inline uint8_t name##_empty(name##_t *r) {                            \
+  return r->head == r->tail;                                                 \
+}                                                                            \
+                                                                             \
+static inline void name##_lost(name##_t *r, uint8_t len) {                  \
+  uint16_t d = r->drops + len;                                               \
+                                                                             \
+  r->drops = (d < r->drops ? 0xffff : d);                                    \
+}                                                                            \
+                                                                             \
+static inline uint8_t name##_put(name##_t *r, type data) {                   \
+  uint8_t h = r->head;                                                       \
+  uint8_t n = (h + 1) & ((1 << (shift)) - 1);                                \
+  uint8_t c;                                                                 \
+                                                                             \
+  if(n == r->tail) {                                                         \
+    name##_lost(r, 1);                                                       \
+    return 0;                                                                \
+  }                                                                          \
+  r->buf[h] = data;                                                          \
+  RING_BARRIER();                                                            \
+  r->head = n;                                                               \
+  c = (uint8_t)(n - r->tail) & ((1 << (shift)) - 1);                         \
+  if(c > r->hiwater)                                                         \
+    r->hiwater = c;                                                          \
+  return 1;                                                                  \
+}                                                                            \
+                                                                             \
+/* queue up to len elements, returns the number queued */                    \
+static inline uint8_t name##_put_n(name##_t *r, const type *data,            \
+                                   uint8_t len) {                            \
+  uint8_t i;                                                                 \
+                                                                             \
+  for(i = 0; i < len; i++) {                                                 \
+    if(!name##_put(r, data[i])) {                                            \
+      name##_lost(r, len - i - 1);                                           \
+      break;                                                                 \
+    }                                                                        \
+  }                                                                          \
+  return i;                                                                  \
+}                                                                            \
+                                                                             \
+/* ring must not be empty */                                                 \
+static inline type name##_peek(name##_t *r) {                                \
+  return r->buf[r->tail];                                                    \
+}                                                                            \
+                                                                             \
+/* ring must not be empty */                                                 \
+static inline type name##_get(name##_t *r) {                                 \
+  uint8_t t = r->tail;                                                       \
+  type data = r->buf[t];                                                     \
+                                                                             \
+  RING_BARRIER();                                                            \
+  r->tail = (t + 1) & ((1 << (shift)) - 1);                                  \
+  return data;                                                               \
+}                                                                            \
+                                                                             \
+/* drop everything queued, consumer side */                                  \
+static inline void name##_flush(name##_t *r) {                               \
+  r->tail = r->head;                                                         \
+}                                                                            \
+                                                                             \
+/* dequeue up to len elements, returns the number dequeued */                \
+static inline uint8_t name##_drain(name##_t *r, type *data, uint8_t len) {   \
+  uint8_t t = r->tail;                                                       \
+  uint8_t h = r->head;                                                       \
+  uint8_t i = 0;                                                             \
+                                                                             \
+  while(t != h && i < len) {                                                 \
+    data[i++] = r->buf[t];                                                   \
+    t = (t + 1) & ((1 << (shift)) - 1);                                      \
+  }                                                                          \
+  RING_BARRIER();                                                            \
+  r->tail = t;                                                               \
+  return i;                                                                  \
+}                                                                            \
+                                                                             \
+static inline uint8_t name##_hiwater(name##_t *r) {                          \
+  return r->hiwater;                                                         \
+}                                                                            \
+                                                                             \
+static inline uint16_t name##_drops(name##_t *r) {                           \
+  uint16_t d;                                                                \
+                                                                             \
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {                                        \
+    d = r->drops;                                                            \
+  }                                                                          \
+  return d;                                                                  \
+}
+
+#endif /* RING_H */
@@ -26,31 +26,28 @@
 #include <avr/interrupt.h>
 #include <avr/pgmspace.h>
 #include "config.h"
+#include "ring.h"
 #include "uart.h"
 
 #ifdef UART0_ENABLE
 #  if defined UART0_TX_BUFFER_SHIFT && UART0_TX_BUFFER_SHIFT > 0
-static uint8_t          tx0_buf[1 << UART0_TX_BUFFER_SHIFT];
-static volatile uint8_t tx0_tail;
-static volatile uint8_t tx0_head;
+RING_DEFINE(tx0_ring, uint8_t, UART0_TX_BUFFER_SHIFT)
+static tx0_ring_t       tx0_buf;
 #  endif
 #  if defined UART0_RX_BUFFER_SHIFT && UART0_RX_BUFFER_SHIFT > 0
-static uint8_t          rx0_buf[1 << UART0_RX_BUFFER_SHIFT];
-static volatile uint8_t rx0_tail;
-static volatile uint8_t rx0_head;
+RING_DEFINE(rx0_ring, uint8_t, UART0_RX_BUFFER_SHIFT)
+static rx0_ring_t       rx0_buf;
 #  endif
 #endif
 
 #ifdef UART1_ENABLE
 #  if defined UART1_TX_BUFFER_SHIFT && UART1_TX_BUFFER_SHIFT > 0
-static uint8_t          tx1_buf[1 << UART1_TX_BUFFER_SHIFT];
-static volatile uint8_t tx1_tail;
-static volatile uint8_t tx1_head;
+RING_DEFINE(tx1_ring, uint8_t, UART1_TX_BUFFER_SHIFT)
+static tx1_ring_t       tx1_buf;
 #  endif
 #  if defined UART1_RX_BUFFER_SHIFT && UART1_RX_BUFFER_SHIFT > 0
-static uint8_t          rx1_buf[1 << UART1_RX_BUFFER_SHIFT];
-static volatile uint8_t rx1_head;
-static volatile uint8_t rx1_tail;
+RING_DEFINE(rx1_ring, uint8_t, UART1_RX_BUFFER_SHIFT)
+static rx1_ring_t       rx1_buf;
 #  endif
 #endif
 
@@ -58,10 +55,8 @@ static volatile uint8_t rx1_tail;
 #if defined UART0_ENABLE
 #  if defined UART0_TX_BUFFER_SHIFT && UART0_TX_BUFFER_SHIFT > 0
 ISR(USARTA_UDRE_vect) {
-  if ( tx0_head != tx0_tail ) {
-    UDRA = tx0_buf[tx0_tail];     /* Start transmition */
-    /* Calculate and store buffer index */
-    tx0_tail = (tx0_tail + 1) & (sizeof(tx0_buf) - 1);
+  if ( !tx0_ring_empty(&tx0_buf) ) {
+    UDRA = tx0_ring_get(&tx0_buf);     /* Start transmition */
   } else {
     UCSRAB &= ~ _BV(UDRIEA);  /* Disable interrupt */
   }
@@ -70,34 +65,38 @@ ISR(USARTA_UDRE_vect) {
 
 #  if defined UART0_RX_BUFFER_SHIFT && UART0_RX_BUFFER_SHIFT > 0
 ISR(USARTA_RXC_vect) {
-  /* Calculate and store buffer index */
-  rx0_head = (rx0_head + 1) & (sizeof(rx0_buf) - 1);
-  if ( rx0_head == rx0_tail ) {
-    /* ERROR! Receive buffer overflow */
-  }
-  rx0_buf[rx0_head] = UDRA; /* Read and store received data */
+  uint8_t data = UDRA;  /* always read, to clear the interrupt */
+
+  rx0_ring_put(&rx0_buf, data); /* a full buffer counts the drop */
 }
 #  endif
 
 uint8_t uart0_data_available(void) {
 #if defined UART0_RX_BUFFER_SHIFT && UART0_RX_BUFFER_SHIFT > 0
   /* Return 0 (FALSE) if the receive buffer is empty */
-  return ( rx0_head != rx0_tail );
+  return !rx0_ring_empty(&rx0_buf);
 #else
   return ((UCSRAA & (1 << RXCA)) != 0);
 #endif
 }
 uint8_t uart_data_available(void) __attribute__ ((weak, alias("uart0_data_available")));
 
+#  if defined UART0_RX_BUFFER_SHIFT && UART0_RX_BUFFER_SHIFT > 0
+uint8_t uart0_rx_hiwater(void) {
+  return rx0_ring_hiwater(&rx0_buf);
+}
+
+uint16_t uart0_rx_drops(void) {
+  return rx0_ring_drops(&rx0_buf);
+}
+#  endif
+
 void uart0_putc(uint8_t data) {
 #if defined UART0_TX_BUFFER_SHIFT && UART0_TX_BUFFER_SHIFT > 0
-  /* Calculate buffer index */
-  uint8_t t = (tx0_head + 1) & (sizeof(tx0_buf) - 1);
-  while(t == tx0_tail);  /* Wait for free space in buffer */
+  while(!tx0_ring_free(&tx0_buf));  /* Wait for free space in buffer */
 
-  tx0_buf[tx0_head] = data;    /* Store data in buffer */
-  tx0_head = t;                /* Store new index */
-  UCSRAB |= _BV(UDRIEA);       /* Enable UDR0E interrupt */
+  tx0_ring_put(&tx0_buf, data);     /* Store data in buffer */
+  UCSRAB |= _BV(UDRIEA);            /* Enable UDR0E interrupt */
 #else
   loop_until_bit_is_set(UCSRAA,UDREA);
   UDRA = data;
@@ -107,10 +106,8 @@ void uart_putc(uint8_t data) __attribute__ ((weak, alias("uart0_putc")));
 
 uint8_t uart0_getc(void) {
 #  if defined UART0_RX_BUFFER_SHIFT && UART0_RX_BUFFER_SHIFT > 0
-  while (rx0_head == rx0_tail) {;}
-  /* Calculate and store buffer index */
-  rx0_tail = ( rx0_tail + 1 ) & (sizeof(rx0_buf)-1);
-  return rx0_buf[rx0_tail];           /* Return data */
+  while (rx0_ring_empty(&rx0_buf)) {;}
+  return rx0_ring_get(&rx0_buf);      /* Return data */
 #  else
   loop_until_bit_is_set(UCSRAA,RXCA);
   return UDRA;
@@ -120,7 +117,7 @@ uint8_t uart_getc(void) __attribute__ ((weak, alias("uart0_getc")));
 
 void uart0_flush(void) {
 #  if defined UART0_TX_BUFFER_SHIFT && UART0_TX_BUFFER_SHIFT > 0
-  while (tx0_head != tx0_tail) ;
+  while (!tx0_ring_empty(&tx0_buf)) ;
 #  endif
 }
 void uart_flush(void) __attribute__ ((weak, alias("uart0_flush")));
@@ -234,10 +231,8 @@ static FILE mystdout = FDEV_SETUP_STREAM(ioputc, NULL, _FDEV_SETUP_WRITE);
 #ifdef UART1_ENABLE
 #  if defined UART1_TX_BUFFER_SHIFT && UART1_TX_BUFFER_SHIFT > 0
 ISR(USARTB_UDRE_vect) {
-  if ( tx1_head != tx1_tail ) {
-    UDRB = tx1_buf[tx1_tail];     /* Start transmition */
-    /* Calculate and store buffer index */
-    tx1_tail = (tx1_tail + 1) & (sizeof(tx1_buf) - 1);
+  if ( !tx1_ring_empty(&tx1_buf) ) {
+    UDRB = tx1_ring_get(&tx1_buf);     /* Start transmition */
   } else {
     UCSRBB &= ~ _BV(UDRIEB);  /* Disable interrupt */
   }
@@ -246,22 +241,17 @@ ISR(USARTB_UDRE_vect) {
 
 #  if defined UART1_RX_BUFFER_SHIFT && UART1_RX_BUFFER_SHIFT > 0
 ISR(USARTB_RXC_vect) {
-  /* Calculate and store buffer index */
-  rx1_head = ( rx1_head + 1 ) & (sizeof(rx1_buf) - 1);
-  if ( rx1_head == rx1_tail ) {
-    /* ERROR! Receive buffer overflow */
-  }
-  rx1_buf[rx1_head] = UDRB; /* Read and store received data */
+  uint8_t data = UDRB;  /* always read, to clear the interrupt */
+
+  rx1_ring_put(&rx1_buf, data); /* a full buffer counts the drop */
 }
 #  endif
 
 
 void uart1_putc(char data) {
 #  if defined UART1_TX_BUFFER_SHIFT && UART1_TX_BUFFER_SHIFT > 0
-  uint8_t t = (tx1_head + 1) & (sizeof(tx1_buf) - 1);
-  UCSRBB &= ~ _BV(UDRIEB);   // turn off RS232 irq
-  tx1_buf[tx1_head] = data;
-  tx1_head = t;
+  while(!tx1_ring_free(&tx1_buf));  /* Wait for free space in buffer */
+  tx1_ring_put(&tx1_buf, data);
   UCSRBB |= _BV(UDRIEB);
 #  else
   loop_until_bit_is_set(UCSRBA,UDREB);
@@ -274,14 +264,8 @@ uint8_t uart1_getc(void) {
   loop_until_bit_is_set(UCSRBA,RXCB);
   return UDRB;
 #else
-  uint8_t tmptail;
-
-  while ( rx1_head == rx1_tail ) { ; }
-  tmptail = ( rx1_tail + 1 ) & (sizeof(rx1_buf)-1);/* Calculate buffer index */
-
-  rx1_tail = tmptail;                /* Store new index */
-
-  return rx1_buf[tmptail];           /* Return data */
+  while ( rx1_ring_empty(&rx1_buf) ) { ; }
+  return rx1_ring_get(&rx1_buf);     /* Return data */
 #endif
 }
 
@@ -326,12 +310,10 @@ void uart_init(void) {
 
   /* Flush buffers */
     #if defined UART0_TX_BUFFER_SHIFT && UART0_TX_BUFFER_SHIFT > 0
-  tx0_tail = 0;
-  tx0_head = 0;
+  tx0_ring_init(&tx0_buf);
     #endif
     #if defined UART0_RX_BUFFER_SHIFT && UART0_RX_BUFFER_SHIFT > 0
-  rx0_tail = 0;
-  rx0_head = 0;
+  rx0_ring_init(&rx0_buf);
     #endif
 
     #ifdef UART_USE_PRINTF
@@ -356,12 +338,10 @@ void uart_init(void) {
 
   /* Flush buffers */
 #    if defined UART1_TX_BUFFER_SHIFT && UART1_TX_BUFFER_SHIFT > 0
-  tx1_tail = 0;
-  tx1_head = 0;
+  tx1_ring_init(&tx1_buf);
 #    endif
 #    if defined UART1_RX_BUFFER_SHIFT && UART1_RX_BUFFER_SHIFT > 0
-  rx1_tail = 0;
-  rx1_head = 0;
+  rx1_ring_init(&rx1_buf);
 #    endif
 #  endif
 }
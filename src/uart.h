@@ -328,6 +328,10 @@ void uart0_flush(void);
 void uart0_puts_P(const char *text);
 uint8_t uart0_data_available(void);
 void uart0_putcrlf(void);
+#  if defined UART0_RX_BUFFER_SHIFT && UART0_RX_BUFFER_SHIFT > 0
+uint8_t uart0_rx_hiwater(void);
+uint16_t uart0_rx_drops(void);
+#  endif
 #  include <stdio.h>
 #  define dprintf(str,...) printf_P(PSTR(str), ##__VA_ARGS__)
 #else
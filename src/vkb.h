@@ -43,6 +43,26 @@
                                   ) << 3 \
                                  )
 
+// C128 K line k: read with C64 column c, in the slots after the row port's
+#define SCAN_MAP_K(k,c)          ( \
+                                  ( \
+                                   k == 0 ? SCAN_KLINE_0 : \
+                                   k == 1 ? SCAN_KLINE_1 : SCAN_KLINE_2 \
+                                  ) \
+                                 | \
+                                  (KB_MAX_ROWS + \
+                                   ( \
+                                    c == 0 ? SCAN_COL_0 : \
+                                    c == 1 ? SCAN_COL_1 : \
+                                    c == 2 ? SCAN_COL_2 : \
+                                    c == 3 ? SCAN_COL_3 : \
+                                    c == 4 ? SCAN_COL_4 : \
+                                    c == 5 ? SCAN_COL_5 : \
+                                    c == 6 ? SCAN_COL_6 : SCAN_COL_7 \
+                                   ) \
+                                  ) << 3 \
+                                 )
+
 #define MATRIX_MAP(x,y)         ( \
                                  ( \
                                   ( \
@@ -72,6 +92,7 @@
                                 )
 void vkb_init(void);
 void vkb_irq(void);
+void vkb_irq_sample(void);
 void vkb_scan(void);
 
 #endif
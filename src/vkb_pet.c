@@ -21,18 +21,23 @@
 #include <avr/io.h>
 #include <avr/interrupt.h>
 #include <inttypes.h>
+#include <string.h>
 #include <avr/pgmspace.h>
 #include <avr/eeprom.h>
+#include <avr/sleep.h>
+#include <util/atomic.h>
 #include <util/delay.h>
 
 #include "config.h"
 
 #include "debug.h"
 #include "eeprom.h"
+#include "joy.h"
 #include "kb.h"
 #include "kb_macro.h"
 #include "uart.h"
 #include "vkb.h"
+#include "xptq.h"
 
 #include "vkb_pet.h"
 
@@ -47,30 +52,85 @@ typedef enum {
   OPTST_JOYRT,
   OPTST_JOYF1,
   OPTST_JOYF2,
+  OPTST_REPEAT_RATE,
+  OPTST_REPEAT_DELAY,
+  OPTST_AUTOFIRE_JOY,
+  OPTST_AUTOFIRE_RATE,
+  OPTST_PACE,
   OPTST_DEBUG
 } opstates_t;
 
+// switches set_vkey() pressed for a key, and the modifiers at the time
+typedef struct {
+  uint8_t key;
+  uint8_t meta;
+  uint8_t unshifted;
+  uint8_t shifted;
+  uint8_t cmdr;
+} vkey_t;
+
+// PET keyboard scan timing, in scan ticks
+typedef struct {
+  uint16_t hold;    // key down, or shift changed before a key
+  uint16_t gap;     // key up before another key goes down
+  uint16_t same;    // key up before the same key goes down again
+} pace_t;
+
 
 static uint8_t _debug = FALSE;
+#if KB_SOURCES > 1
+// modifiers are kept per keyboard, _meta is the one the event came from
+static uint8_t _metas[KB_SOURCES];
+static uint8_t _src;
+#  define _meta               _metas[_src]
+#else
 static uint8_t _meta = 0;
+#endif
 //static uint8_t _config_meta = 0;
-static uint8_t _shift_override_key = MAT_PET_KEY_NONE;
+static uint8_t _pet_shift;      // META shift flags closed on the PET
+static uint8_t _plan_new;       // PLAN_xxx changes the PET may not have seen
+static uint8_t _plan_forced;    // keys down with a shift state of their own
+static uint8_t _plan_held[16];  // PET switches set_vkey() closed
+static uint8_t _plan_force[16]; // those closed with a shift state of their own
 static uint8_t _config = FALSE;
 //static uint8_t _config = TRUE;
-static uint8_t _buf[64]; // TODO fix buffer overrun error.
+static uint8_t _buf[MACRO_LEN_MAX];
+
+/*
+ * Most output queue entries one key event makes: a macro, each key
+ * letting the last one go, changing shift and going down, plus both
+ * shifts first and last.  Typed strings are shorter than a macro.  An
+ * event waits in the keyboard queue until this much room is free.
+ */
+#define EVENT_XPT_MAX  (3 * MACRO_LEN_MAX + 4)
+#if EVENT_XPT_MAX > (1 << XPTQ_SHIFT) - 1
+#  error "XPTQ_SHIFT too small for the longest macro"
+#endif
 
 static opstates_t _opt_state = OPTST_IDLE;
 static uint8_t _opt_num;
-static uint8_t _joy_keys[2][6];
 static uint8_t _key;
+static uint8_t _held[16];       // scan codes down, to spot repeats
+static vkey_t _last_vkey;
+static vkey_t _rpt_vkey;        // key repeating, or key KB_NO_REPEAT
+static config_t _cfg;
+static pace_t _pace;
 
 
 void vkb_irq(void) {
   kb_scan();
+  joy_scan();
+  xptq_run();
   //DDRB |= _BV(PIN7);
   //PORTB ^= _BV(PIN7);
 }
 
+#ifdef SCAN_SAMPLE_TIMER
+void vkb_irq_sample(void) {
+  kb_sample();
+}
+#endif
+
 #define META_FLAG_LSHIFT    0x01
 #define META_FLAG_RSHIFT    0x02
 #define META_FLAG_CTRL      0x04
@@ -78,133 +138,96 @@ void vkb_irq(void) {
 #define META_SHIFT_MASK     (META_FLAG_LSHIFT | META_FLAG_RSHIFT)
 
 #define IS_SHIFTED()        (_meta & META_SHIFT_MASK)
-#define DELAY_JIFFY()       _delay_ms(1000/50)
+// hold off the next queued switch change until the PET has scanned
+#define WAIT_TICKS(t)       do { \
+                              xptq_delay(t); \
+                              _plan_new = 0; \
+                            } while(0)
+#define WAIT_JIFFY()        WAIT_TICKS(_pace.hold)
+
+#define PLAN_SHIFT_NEW      1   // planned shift change
+#define PLAN_KEY_NEW        2   // key pressed with a shift state of its own
 
 
 #define SW_SHIFT_OVERRIDE   0x80
 #define SW_VALUE_MASK       (uint8_t)~SW_SHIFT_OVERRIDE
 
-static uint8_t ascii_map[] = {
-                              MAT_PET_KEY_SPACE,
-                              MAT_PET_KEY_EXCLAMATION,
-                              MAT_PET_KEY_DOUBLE_QUOTE,
-                              MAT_PET_KEY_HASH,
-                              MAT_PET_KEY_DOLLAR_SIGN,
-                              MAT_PET_KEY_PERCENT,
-                              MAT_PET_KEY_AMPERSAND,
-                              MAT_PET_KEY_APOSTROPHE,
-                              MAT_PET_KEY_LEFT_PAREN,
-                              MAT_PET_KEY_RIGHT_PAREN,
-                              MAT_PET_KEY_ASTERIX,
-                              MAT_PET_KEY_PLUS,
-                              MAT_PET_KEY_COMMA,
-                              MAT_PET_KEY_MINUS,
-                              MAT_PET_KEY_PERIOD,
-                              MAT_PET_KEY_SLASH,
-                              MAT_PET_KEY_0,
-                              MAT_PET_KEY_1,
-                              MAT_PET_KEY_2,
-                              MAT_PET_KEY_3,
-                              MAT_PET_KEY_4,
-                              MAT_PET_KEY_5,
-                              MAT_PET_KEY_6,
-                              MAT_PET_KEY_7,
-                              MAT_PET_KEY_8,
-                              MAT_PET_KEY_9,
-                              MAT_PET_KEY_COLON,
-                              MAT_PET_KEY_SEMICOLON,
-                              MAT_PET_KEY_LESS_THAN,
-                              MAT_PET_KEY_EQUALS,
-                              MAT_PET_KEY_GREATER_THAN,
-                              MAT_PET_KEY_QUESTION_MARK,
-                              MAT_PET_KEY_AT,
-                              MAT_PET_KEY_A,
-                              MAT_PET_KEY_B,
-                              MAT_PET_KEY_C,
-                              MAT_PET_KEY_D,
-                              MAT_PET_KEY_E,
-                              MAT_PET_KEY_F,
-                              MAT_PET_KEY_G,
-                              MAT_PET_KEY_H,
-                              MAT_PET_KEY_I,
-                              MAT_PET_KEY_J,
-                              MAT_PET_KEY_K,
-                              MAT_PET_KEY_L,
-                              MAT_PET_KEY_M,
-                              MAT_PET_KEY_N,
-                              MAT_PET_KEY_O,
-                              MAT_PET_KEY_P,
-                              MAT_PET_KEY_Q,
-                              MAT_PET_KEY_R,
-                              MAT_PET_KEY_S,
-                              MAT_PET_KEY_T,
-                              MAT_PET_KEY_U,
-                              MAT_PET_KEY_V,
-                              MAT_PET_KEY_W,
-                              MAT_PET_KEY_X,
-                              MAT_PET_KEY_Y,
-                              MAT_PET_KEY_Z,
-                              MAT_PET_KEY_LEFT_BRACKET,
-                              MAT_PET_KEY_NONE, // backslash
-                              MAT_PET_KEY_RIGHT_BRACKET,
-                              MAT_PET_KEY_UP_ARROW,
+#define REPEAT_RATE_DEFAULT   5   // 10 per second
+#define REPEAT_DELAY_DEFAULT  5   // 500 ms
+#define PACE_DEFAULT          0
+#define JOY_KEY_NONE          0xff
+
+// repeat period in ms for repeat rates 1-9.  Each repeat holds the key up
+// for a jiffy and the PET needs another to see it down, so 40 ms is the floor.
+static const uint16_t repeat_period[9] PROGMEM = {
+                                                  500, 333, 250, 167, 100,
+                                                  83, 67, 50, 40
+                                                 };
+
+#define PACE(hold, gap, same) {KB_MS_TO_TICKS_UP(hold), KB_MS_TO_TICKS_UP(gap), \
+                               KB_MS_TO_TICKS_UP(same)}
+
+/*
+ * Pacing profiles, by jiffy and by how many scans the ROM wants a key in.
+ * BASIC 2 and 4 take a key read in one scan, the 40 and 80 column ROMs
+ * alike, the original 2001 ROM wants it in two running.  Hold and same
+ * are the shortest make petscan -s finds losing no key, plus a tick.
+ * Rates are make petscan's slowest for the function key strings.
+ */
+static const pace_t pace_tbl[] PROGMEM = {
+                              PACE(21, 2, 21),  // 0: BASIC 2/4, 50Hz, 41.9/s
+                              PACE(35, 2, 18),  // 1: original ROM, 60Hz, 26.7/s
+                              PACE(18, 2, 18),  // 2: BASIC 2/4, 60Hz, 48.2/s
+                              PACE(41, 2, 21),  // 3: original ROM, 50Hz, 22.9/s
                              };
 
+#define PACE_TBL_SZ         (sizeof(pace_tbl) / sizeof(pace_tbl[0]))
+
+/*
+ * Floors for every profile.  No PET scans more than 60 times a second, so
+ * a key down or up for less than a jiffy can fall between two scans.  A
+ * key let go as the next goes down can be read down with it by a scan
+ * running at that moment, and the ROM may take the old one, so the next
+ * key waits out a scan, about 1.5 ms.  test/petscan.c has the model.
+ */
+#define PACE_HOLD_MIN       KB_MS_TO_TICKS_UP(1000 / 60 + 1)
+#define PACE_GAP_MIN        KB_MS_TO_TICKS_UP(2)
+
+#ifdef JOYSTICK
+// autofire rates 1-9, in shots per second
+static const uint8_t autofire_hz[9] PROGMEM = {5, 8, 10, 12, 15, 18, 20, 25, 30};
+#endif
+
 #define ASCII_MAP_TBL_SZ    (sizeof(ascii_map)/sizeof(ascii_map[0]))
 
-static uint8_t key_map[][5] = {
-                               {' ', SCAN_C64_KEY_SPACE, MAT_PET_KEY_SPACE, MAT_PET_KEY_SPACE, MAT_PET_KEY_NONE},
-                               {'*', SCAN_C64_KEY_ASTERIX, MAT_PET_KEY_ASTERIX, MAT_PET_KEY_AT, MAT_PET_KEY_LEFT_ARROW | SW_SHIFT_OVERRIDE},
-                               {'+', SCAN_C64_KEY_PLUS, MAT_PET_KEY_PLUS, MAT_PET_KEY_LEFT_BRACKET, MAT_PET_KEY_AMPERSAND | SW_SHIFT_OVERRIDE},
-                               {',', SCAN_C64_KEY_COMMA, MAT_PET_KEY_COMMA, MAT_PET_KEY_LESS_THAN | SW_SHIFT_OVERRIDE, MAT_PET_KEY_NONE},
-                               {'-', SCAN_C64_KEY_MINUS, MAT_PET_KEY_MINUS, MAT_PET_KEY_RIGHT_BRACKET, MAT_PET_KEY_BACKSLASH | SW_SHIFT_OVERRIDE},
-                               {'.', SCAN_C64_KEY_PERIOD, MAT_PET_KEY_PERIOD, MAT_PET_KEY_GREATER_THAN | SW_SHIFT_OVERRIDE, MAT_PET_KEY_NONE},
-                               {'/', SCAN_C64_KEY_SLASH, MAT_PET_KEY_SLASH, MAT_PET_KEY_QUESTION_MARK | SW_SHIFT_OVERRIDE, MAT_PET_KEY_NONE},
-                               {'0', SCAN_C64_KEY_0, MAT_PET_KEY_0, MAT_PET_KEY_0, MAT_PET_KEY_REVERSE | SW_SHIFT_OVERRIDE},
-                               {'1', SCAN_C64_KEY_1, MAT_PET_KEY_1, MAT_PET_KEY_EXCLAMATION | SW_SHIFT_OVERRIDE, MAT_PET_KEY_NONE},
-                               {'2', SCAN_C64_KEY_2, MAT_PET_KEY_2, MAT_PET_KEY_DOUBLE_QUOTE | SW_SHIFT_OVERRIDE, MAT_PET_KEY_NONE},
-                               {'3', SCAN_C64_KEY_3, MAT_PET_KEY_3, MAT_PET_KEY_HASH | SW_SHIFT_OVERRIDE, MAT_PET_KEY_NONE},
-                               {'4', SCAN_C64_KEY_4, MAT_PET_KEY_4, MAT_PET_KEY_DOLLAR_SIGN | SW_SHIFT_OVERRIDE, MAT_PET_KEY_NONE},
-                               {'5', SCAN_C64_KEY_5, MAT_PET_KEY_5, MAT_PET_KEY_PERCENT | SW_SHIFT_OVERRIDE, MAT_PET_KEY_NONE},
-                               {'6', SCAN_C64_KEY_6, MAT_PET_KEY_6, MAT_PET_KEY_AMPERSAND | SW_SHIFT_OVERRIDE, MAT_PET_KEY_NONE},
-                               {'7', SCAN_C64_KEY_7, MAT_PET_KEY_7, MAT_PET_KEY_APOSTROPHE | SW_SHIFT_OVERRIDE, MAT_PET_KEY_NONE},
-                               {'8', SCAN_C64_KEY_8, MAT_PET_KEY_8, MAT_PET_KEY_LEFT_PAREN | SW_SHIFT_OVERRIDE, MAT_PET_KEY_NONE},
-                               {'9', SCAN_C64_KEY_9, MAT_PET_KEY_9, MAT_PET_KEY_RIGHT_PAREN | SW_SHIFT_OVERRIDE, MAT_PET_KEY_REVERSE},
-                               {':', SCAN_C64_KEY_COLON, MAT_PET_KEY_COLON, MAT_PET_KEY_LEFT_BRACKET | SW_SHIFT_OVERRIDE, MAT_PET_KEY_NONE},
-                               {';', SCAN_C64_KEY_SEMICOLON, MAT_PET_KEY_SEMICOLON, MAT_PET_KEY_RIGHT_BRACKET | SW_SHIFT_OVERRIDE, MAT_PET_KEY_NONE},
-                               {'=', SCAN_C64_KEY_EQUALS, MAT_PET_KEY_EQUALS, MAT_PET_KEY_NONE, MAT_PET_KEY_NONE},
-                               {'@', SCAN_C64_KEY_AT, MAT_PET_KEY_AT, MAT_PET_KEY_COLON, MAT_PET_KEY_DOLLAR_SIGN | SW_SHIFT_OVERRIDE},
-                               {'A', SCAN_C64_KEY_A, MAT_PET_KEY_A, MAT_PET_KEY_A, MAT_PET_KEY_0 | SW_SHIFT_OVERRIDE},
-                               {'B', SCAN_C64_KEY_B, MAT_PET_KEY_B, MAT_PET_KEY_B, MAT_PET_KEY_QUESTION_MARK | SW_SHIFT_OVERRIDE},
-                               {'C', SCAN_C64_KEY_C, MAT_PET_KEY_C, MAT_PET_KEY_C, MAT_PET_KEY_LESS_THAN | SW_SHIFT_OVERRIDE},
-                               {'D', SCAN_C64_KEY_D, MAT_PET_KEY_D, MAT_PET_KEY_D, MAT_PET_KEY_COMMA | SW_SHIFT_OVERRIDE},
-                               {'E', SCAN_C64_KEY_E, MAT_PET_KEY_E, MAT_PET_KEY_E, MAT_PET_KEY_1 | SW_SHIFT_OVERRIDE},
-                               {'F', SCAN_C64_KEY_F, MAT_PET_KEY_F, MAT_PET_KEY_F, MAT_PET_KEY_SEMICOLON | SW_SHIFT_OVERRIDE},
-                               {'G', SCAN_C64_KEY_G, MAT_PET_KEY_G, MAT_PET_KEY_G, MAT_PET_KEY_PERCENT | SW_SHIFT_OVERRIDE},
-                               {'H', SCAN_C64_KEY_H, MAT_PET_KEY_H, MAT_PET_KEY_H, MAT_PET_KEY_4 | SW_SHIFT_OVERRIDE},
-                               {'I', SCAN_C64_KEY_I, MAT_PET_KEY_I, MAT_PET_KEY_I, MAT_PET_KEY_DOUBLE_QUOTE | SW_SHIFT_OVERRIDE},
-                               {'J', SCAN_C64_KEY_J, MAT_PET_KEY_J, MAT_PET_KEY_J, MAT_PET_KEY_5 | SW_SHIFT_OVERRIDE},
-                               {'K', SCAN_C64_KEY_K, MAT_PET_KEY_K, MAT_PET_KEY_K, MAT_PET_KEY_EXCLAMATION | SW_SHIFT_OVERRIDE},
-                               {'L', SCAN_C64_KEY_L, MAT_PET_KEY_L, MAT_PET_KEY_L, MAT_PET_KEY_6 | SW_SHIFT_OVERRIDE},
-                               {'M', SCAN_C64_KEY_M, MAT_PET_KEY_M, MAT_PET_KEY_M, MAT_PET_KEY_APOSTROPHE | SW_SHIFT_OVERRIDE},
-                               {'N', SCAN_C64_KEY_N, MAT_PET_KEY_N, MAT_PET_KEY_N, MAT_PET_KEY_ASTERIX | SW_SHIFT_OVERRIDE},
-                               {'O', SCAN_C64_KEY_O, MAT_PET_KEY_O, MAT_PET_KEY_O, MAT_PET_KEY_9 | SW_SHIFT_OVERRIDE},
-                               {'P', SCAN_C64_KEY_P, MAT_PET_KEY_P, MAT_PET_KEY_P, MAT_PET_KEY_SLASH | SW_SHIFT_OVERRIDE},
-                               {'Q', SCAN_C64_KEY_Q, MAT_PET_KEY_Q, MAT_PET_KEY_Q, MAT_PET_KEY_PLUS | SW_SHIFT_OVERRIDE},
-                               {'R', SCAN_C64_KEY_R, MAT_PET_KEY_R, MAT_PET_KEY_R, MAT_PET_KEY_2 | SW_SHIFT_OVERRIDE},
-                               {'S', SCAN_C64_KEY_S, MAT_PET_KEY_S, MAT_PET_KEY_S, MAT_PET_KEY_PERIOD | SW_SHIFT_OVERRIDE},
-                               {'T', SCAN_C64_KEY_T, MAT_PET_KEY_T, MAT_PET_KEY_T, MAT_PET_KEY_HASH | SW_SHIFT_OVERRIDE},
-                               {'U', SCAN_C64_KEY_U, MAT_PET_KEY_U, MAT_PET_KEY_U, MAT_PET_KEY_8 | SW_SHIFT_OVERRIDE},
-                               {'V', SCAN_C64_KEY_V, MAT_PET_KEY_V, MAT_PET_KEY_V, MAT_PET_KEY_GREATER_THAN | SW_SHIFT_OVERRIDE},
-                               {'W', SCAN_C64_KEY_W, MAT_PET_KEY_W, MAT_PET_KEY_W, MAT_PET_KEY_3 | SW_SHIFT_OVERRIDE},
-                               {'X', SCAN_C64_KEY_X, MAT_PET_KEY_X, MAT_PET_KEY_X, MAT_PET_KEY_EQUALS | SW_SHIFT_OVERRIDE},
-                               {'Y', SCAN_C64_KEY_Y, MAT_PET_KEY_Y, MAT_PET_KEY_Y, MAT_PET_KEY_7 | SW_SHIFT_OVERRIDE},
-                               {'Z', SCAN_C64_KEY_Z, MAT_PET_KEY_Z, MAT_PET_KEY_Z, MAT_PET_KEY_MINUS | SW_SHIFT_OVERRIDE},
-                               {'\\', SCAN_C64_KEY_POUND, MAT_PET_KEY_BACKSLASH, MAT_PET_KEY_RIGHT_PAREN, MAT_PET_KEY_LEFT_PAREN | SW_SHIFT_OVERRIDE},
-                               {'^', SCAN_C64_KEY_UP_ARROW, MAT_PET_KEY_UP_ARROW, MAT_PET_KEY_UP_ARROW, MAT_PET_KEY_NONE}
-                              };
-
-#define MAP_TBL_SZ          (sizeof(key_map)/sizeof(key_map[0]))
+#define map_ascii_string_P(x) _map_ascii_string_P(PSTR(x))
+
+static const char str_invalid[] PROGMEM = "invalid\r";
+static const char str_invalid_dot[] PROGMEM = ".INVALID\r";
+
+#define KEY_FL_MAP          0x01    // PET keys in the entry
+#define KEY_FL_FUNC         0x02    // function key, types a string
+#define KEY_FL_CFG_SHIFT    0x04    // unshifted key is shifted in CONFIG mode
+
+// translation of one scan code
+typedef struct {
+  uint8_t ch;             // character, for debug and digits, or 0
+  uint8_t flags;
+  uint8_t unshifted;
+  uint8_t shifted;
+  uint8_t cmdr;
+} keydef_t;
+
+// ascii_map and key_tbl, generated from the key mapping CSV
+#define KEYMAP_TABLES
+#include "keymap.h"
+
+static void get_keydef(uint8_t cmp, keydef_t *def) {
+  if(cmp < KB_CODES)
+    memcpy_P(def, &key_tbl[cmp], sizeof(keydef_t));
+  else
+    def->flags = 0;
+}
 
 
 void debug_putkey(uint8_t sw, uint8_t state) {
@@ -224,46 +247,136 @@ void debug_putkey(uint8_t sw, uint8_t state) {
 
 void set_switch(uint8_t sw, uint8_t state) {
   debug_putkey(sw, state);
-  xpt_send(sw,state);
+  xptq_put(sw, state);
+}
+
+
+#if KB_SOURCES > 1
+static uint8_t shift_union(void) {
+  uint8_t i;
+  uint8_t meta = 0;
+
+  for(i = 0; i < KB_SOURCES; i++)
+    meta |= _metas[i];
+  return meta & META_SHIFT_MASK;
+}
+#endif
+
+
+/*
+ * The shift state the keyboards ask for.  All keyboards share the PET
+ * shift keys, so they are down while any keyboard holds them.
+ */
+static uint8_t user_shift(void) {
+#if KB_SOURCES > 1
+  return shift_union();
+#else
+  return _meta & META_SHIFT_MASK;
+#endif
+}
+
+
+// wait a scan if any of the PLAN_xxx changes in flags may be unseen
+static void plan_settle(uint8_t flags) {
+  if(_plan_new & flags)
+    WAIT_JIFFY();
+}
+
+
+/*
+ * Move the PET shift keys to want.  A key pressed with a shift state of
+ * its own is let scanned first, or the PET may see it with the new one.
+ * Shift changes the user made are not planned, they are not spaced.
+ */
+static uint8_t plan_shift(uint8_t want, uint8_t planned) {
+  uint8_t diff = want ^ _pet_shift;
+
+  if(diff) {
+    plan_settle(PLAN_KEY_NEW);
+    if(diff & META_FLAG_LSHIFT)
+      set_switch(MAT_PET_KEY_LSHIFT, want & META_FLAG_LSHIFT);
+    if(diff & META_FLAG_RSHIFT)
+      set_switch(MAT_PET_KEY_RSHIFT, want & META_FLAG_RSHIFT);
+    _pet_shift = want;
+    if(planned)
+      _plan_new |= PLAN_SHIFT_NEW;
+  }
+  return diff;
+}
+
+
+// back to the keyboards' shift state once no key needs another one
+static void plan_restore(void) {
+  if(!_plan_forced)
+    plan_shift(user_shift(), TRUE);
 }
 
 
+// close sw with the PET shift keys in state shift
+static void plan_press(uint8_t sw, uint8_t shift) {
+  uint8_t i = sw >> 3;
+  uint8_t bit = _BV(sw & 7);
+
+  plan_shift(shift, TRUE);
+  plan_settle(PLAN_SHIFT_NEW);  // only a shift change the key depends on
+  set_switch(sw, TRUE);
+  _plan_held[i] |= bit;
+  if(shift != user_shift()) {
+    if(!(_plan_force[i] & bit)) {
+      _plan_force[i] |= bit;
+      _plan_forced++;
+    }
+    _plan_new |= PLAN_KEY_NEW;
+  }
+}
+
+
+static void plan_release(uint8_t sw) {
+  uint8_t i = sw >> 3;
+  uint8_t bit = _BV(sw & 7);
+
+  if(!(_plan_held[i] & bit))
+    return;
+  set_switch(sw, FALSE);
+  _plan_held[i] &= (uint8_t)~bit;
+  if(_plan_force[i] & bit) {
+    _plan_force[i] &= (uint8_t)~bit;
+    _plan_forced--;
+  }
+}
+
+
+static void plan_reset(void) {
+  memset(_plan_held, 0, sizeof(_plan_held));
+  memset(_plan_force, 0, sizeof(_plan_force));
+  _plan_forced = 0;
+  _plan_new = 0;
+  _pet_shift = 0;
+}
+
+
+/*
+ * Press or release the PET key for a C64 key under the current modifiers.
+ * A key flagged SW_SHIFT_OVERRIDE wants the PET shift state the C64 one
+ * doesn't have.  A release opens whichever of the keys was pressed, as
+ * the modifiers may have changed since.
+ */
 static uint8_t set_vkey(uint8_t unshifted, uint8_t shifted, uint8_t cmdr, uint8_t state) {
   uint8_t vkey = MAT_PET_KEY_NONE;
-  // TODO optimize for MAT_PET_KEY_NONE
+  uint8_t shift = _meta & META_SHIFT_MASK;
 
-  if(_shift_override_key != MAT_PET_KEY_NONE) {
-    set_switch(_shift_override_key & ~SW_SHIFT_OVERRIDE, FALSE);
-    _shift_override_key = MAT_PET_KEY_NONE;
-  }
   switch(_meta) {
     case META_FLAG_LSHIFT:
     case META_FLAG_RSHIFT:
     case (META_FLAG_LSHIFT | META_FLAG_RSHIFT):
-      if(!state)
-        set_switch(shifted & ~SW_SHIFT_OVERRIDE, state);
-      if(shifted & SW_SHIFT_OVERRIDE) {        // shift on and virtual unshift needed
-        if(_meta & META_FLAG_LSHIFT)           // do I need to fix left?
-          set_switch(MAT_PET_KEY_LSHIFT, !state);
-        if(_meta & META_FLAG_RSHIFT)           // do I need to fix right?
-          set_switch(MAT_PET_KEY_RSHIFT, !state);
-        _shift_override_key = shifted;
-        DELAY_JIFFY();
-      }
-      if(state)
-        set_switch(shifted & ~SW_SHIFT_OVERRIDE, state);
       vkey = shifted;
+      if(shifted & SW_SHIFT_OVERRIDE)          // virtual unshift needed
+        shift = 0;
       break;
     case META_FLAG_CBM:
-      if(!state)
-        set_switch(cmdr & ~SW_SHIFT_OVERRIDE, state);
-      if(cmdr & SW_SHIFT_OVERRIDE) {           // shift off and virtual shift needed
-        set_switch(MAT_PET_KEY_LSHIFT, state);
-        _shift_override_key = cmdr;
-      }
-      if(state)
-        set_switch(cmdr & ~SW_SHIFT_OVERRIDE, state);
       vkey = cmdr;
+      if(cmdr & SW_SHIFT_OVERRIDE)             // virtual shift needed
+        shift = META_FLAG_LSHIFT;
       break;
     case (META_FLAG_CBM | META_FLAG_LSHIFT):
     case (META_FLAG_CBM | META_FLAG_RSHIFT):
@@ -272,17 +385,24 @@ static uint8_t set_vkey(uint8_t unshifted, uint8_t shifted, uint8_t cmdr, uint8_
       break;
     default:
       // unshifted, no CMDR key
-      if(!state)
-        set_switch(unshifted & ~SW_SHIFT_OVERRIDE, state);
-      if(unshifted & SW_SHIFT_OVERRIDE) {      // shift off and virtual shift needed
-        set_switch(MAT_PET_KEY_LSHIFT, state);
-        _shift_override_key = unshifted;
-      }
-      if(state)
-        set_switch(unshifted & ~SW_SHIFT_OVERRIDE, state);
       vkey = unshifted;
+      if(unshifted & SW_SHIFT_OVERRIDE)        // virtual shift needed
+        shift |= META_FLAG_LSHIFT;
       break;
   }
+  if(state) {
+    _last_vkey.meta = _meta;
+    _last_vkey.unshifted = unshifted;
+    _last_vkey.shifted = shifted;
+    _last_vkey.cmdr = cmdr;
+    if((vkey & SW_VALUE_MASK) != MAT_PET_KEY_NONE)
+      plan_press(vkey & SW_VALUE_MASK, shift);
+  } else {
+    plan_release(unshifted & SW_VALUE_MASK);
+    plan_release(shifted & SW_VALUE_MASK);
+    plan_release(cmdr & SW_VALUE_MASK);
+    plan_restore();
+  }
   // shifted or unshifted key with flags on current shift state;
   vkey = (vkey
          & ~SW_SHIFT_OVERRIDE) | (IS_SHIFTED() ? SW_SHIFT_OVERRIDE : 0);
@@ -290,7 +410,123 @@ static uint8_t set_vkey(uint8_t unshifted, uint8_t shifted, uint8_t cmdr, uint8_
 }
 
 
-static void map_ascii_key(char key) {
+/*
+ * The PET ROMs have no key repeat, so a repeat is a release and a new
+ * press.  Release the switches as last pressed, then press with the
+ * current modifiers, so a shift pressed or let go meanwhile is picked up.
+ */
+static void map_repeat(uint8_t key) {
+  uint8_t meta = _meta;
+
+  if(_config || key != _rpt_vkey.key)
+    return;                              // stale, another key took over
+  _meta = _rpt_vkey.meta;
+  set_vkey(_rpt_vkey.unshifted, _rpt_vkey.shifted, _rpt_vkey.cmdr, FALSE);
+  _meta = meta;
+  WAIT_TICKS(_pace.same);               // let the PET see the key up
+  set_vkey(_rpt_vkey.unshifted, _rpt_vkey.shifted, _rpt_vkey.cmdr, TRUE);
+  _rpt_vkey.meta = meta;
+}
+
+
+static uint8_t release_repeat(void) {
+  uint8_t meta = _meta;
+  uint8_t vkey;
+
+  _meta = _rpt_vkey.meta;
+  vkey = set_vkey(_rpt_vkey.unshifted, _rpt_vkey.shifted, _rpt_vkey.cmdr, FALSE);
+  _meta = meta;
+  _rpt_vkey.key = KB_NO_REPEAT;
+  return vkey;
+}
+
+
+static void stop_repeat(void) {
+  kb_set_repeat_code(KB_NO_REPEAT);
+  _rpt_vkey.key = KB_NO_REPEAT;
+}
+
+
+// open every PET switch, then close the shift keys still held
+static void release_all(void) {
+  stop_repeat();
+  xptq_release_all();
+  plan_reset();
+  plan_shift(user_shift(), FALSE);
+}
+
+
+static void set_pace(void) {
+  memcpy_P(&_pace, &pace_tbl[_cfg.pace], sizeof(_pace));
+  if(_pace.hold < PACE_HOLD_MIN)
+    _pace.hold = PACE_HOLD_MIN;
+  if(_pace.gap < PACE_GAP_MIN)
+    _pace.gap = PACE_GAP_MIN;
+  if(_pace.same < PACE_HOLD_MIN)
+    _pace.same = PACE_HOLD_MIN;
+}
+
+
+static void set_repeat(void) {
+  if(_cfg.repeat_rate) {
+    kb_set_repeat_delay(_cfg.repeat_delay * 100);
+    kb_set_repeat_period(pgm_read_word(&repeat_period[_cfg.repeat_rate - 1]));
+  } else {
+    stop_repeat();
+  }
+}
+
+
+// track keys down, returns TRUE for a key down event of a key already down
+static uint8_t is_repeat(uint8_t key) {
+  uint8_t bit = _BV(key & 7);
+  uint8_t *held = &_held[(key & KB_SCAN_CODE_MASK) >> 3];
+
+  if(key & KB_KEY_UP) {
+    *held &= (uint8_t)~bit;
+    return FALSE;
+  }
+  if(*held & bit)
+    return TRUE;
+  *held |= bit;
+  return FALSE;
+}
+
+
+/*
+ * Typing runs.  The PET only needs each key held for a scan, and a scan
+ * with it up before the same key again, so a typed key is left down until
+ * a scan's length before the next one goes down and shift only changes
+ * between keys that need it.  type_end() lets the last key go.
+ */
+static uint8_t _type_sw = MAT_PET_KEY_NONE;  // typed key still down
+
+static void type_key(uint8_t sw, uint8_t shift) {
+  if(_type_sw != MAT_PET_KEY_NONE) {
+    set_switch(_type_sw, FALSE);
+    if(_type_sw == sw)
+      WAIT_TICKS(_pace.same);       // let the PET see the key up
+    else
+      WAIT_TICKS(_pace.gap);        // or the PET may see both down
+  }
+  plan_shift(shift, TRUE);
+  plan_settle(PLAN_SHIFT_NEW);
+  set_switch(sw, TRUE);
+  _type_sw = sw;
+  WAIT_JIFFY();
+}
+
+
+static void type_end(void) {
+  if(_type_sw != MAT_PET_KEY_NONE) {
+    set_switch(_type_sw, FALSE);
+    _type_sw = MAT_PET_KEY_NONE;
+    WAIT_TICKS(_pace.same);
+  }
+}
+
+
+static void type_ascii(char key) {
   uint8_t map = MAT_PET_KEY_NONE;
   uint8_t pshift = FALSE;
   uint8_t pkey = key;
@@ -304,9 +540,9 @@ static void map_ascii_key(char key) {
 
   switch(pkey) {
     default:
-      if(pkey >= ' ' && pkey <= (ASCII_MAP_TBL_SZ + ' ')) {
+      if(pkey >= ' ' && pkey < (ASCII_MAP_TBL_SZ + ' ')) {
         debug_putc(key);
-        map = ascii_map[pkey - ' '];
+        map = pgm_read_byte(&ascii_map[pkey - ' ']);
       }
       break;
     case 13:
@@ -316,68 +552,74 @@ static void map_ascii_key(char key) {
       pshift = _config;
       break;
   }
-  if(map != MAT_PET_KEY_NONE) {
-    if(pshift)
-      set_switch(MAT_PET_KEY_LSHIFT, TRUE);
-    set_switch(map, TRUE);
-    DELAY_JIFFY();
-    set_switch(map, FALSE);
-    if(pshift)
-      set_switch(MAT_PET_KEY_LSHIFT, FALSE);
-    DELAY_JIFFY();
-  }
+  if(map != MAT_PET_KEY_NONE)
+    type_key(map, (pshift ? META_FLAG_LSHIFT : 0));
+}
+
+
+static void map_ascii_key(char key) {
+  type_ascii(key);
+  type_end();
+  plan_restore();
 }
 
 
-static void map_ascii_string(char *str) {
-  char *p = &str[0];
+// type a string from flash
+static void _map_ascii_string_P(const char *str) {
+  char c;
 
-  if(_meta & META_FLAG_LSHIFT)           // do I need to fix left?
-    set_switch(MAT_PET_KEY_LSHIFT, FALSE);
-  if(_meta & META_FLAG_RSHIFT)           // do I need to fix right?
-    set_switch(MAT_PET_KEY_RSHIFT, FALSE);
-  while(*p) {
-    map_ascii_key(*p);
-    p++;
+  while((c = pgm_read_byte(str++))) {
+    type_ascii(c);
   }
-  if(_meta & META_FLAG_LSHIFT)           // do I need to fix left?
-    set_switch(MAT_PET_KEY_LSHIFT, TRUE);
-  if(_meta & META_FLAG_RSHIFT)           // do I need to fix right?
-    set_switch(MAT_PET_KEY_RSHIFT, TRUE);
+  type_end();
+  plan_restore();
+}
+
+
+// the PET follows at once, unless a key down needs another shift state
+static void set_shift_key(uint8_t flag, uint8_t state) {
+  _meta = (_meta & ~flag) | (state ? flag : 0);
+  if(!_plan_forced)
+    plan_shift(user_shift(), FALSE);
 }
 
 
-static void map_meta_key(uint8_t key, uint8_t state) {
+// returns TRUE for modifier keys
+static uint8_t map_meta_key(uint8_t key, uint8_t state) {
   switch(key) {
     case SCAN_C64_KEY_LSHIFT:
-      debug_puts("LSHIFT");
-      _meta = (_meta & ~META_FLAG_LSHIFT) | (state ? META_FLAG_LSHIFT: 0);
-      set_vkey(MAT_PET_KEY_LSHIFT, MAT_PET_KEY_LSHIFT, MAT_PET_KEY_LSHIFT, state);
+      debug_puts_P("LSHIFT");
+      set_shift_key(META_FLAG_LSHIFT, state);
       break;
     case SCAN_C64_KEY_RSHIFT:
-      debug_puts("RSHIFT");
-      _meta = (_meta & ~META_FLAG_RSHIFT) | (state ? META_FLAG_RSHIFT: 0);
-      set_vkey(MAT_PET_KEY_RSHIFT, MAT_PET_KEY_RSHIFT, MAT_PET_KEY_RSHIFT, state);
+      debug_puts_P("RSHIFT");
+      set_shift_key(META_FLAG_RSHIFT, state);
       break;
 
     case SCAN_C64_KEY_CBM:
-      debug_puts("CBM");
+#ifdef KB_C128
+    case SCAN_C128_KEY_ALT:  // no PET equivalent, acts as a second CBM key
+#endif
+      debug_puts_P("CBM");
       // no key to depress
       _meta = (_meta & ~META_FLAG_CBM) | (state ? META_FLAG_CBM: 0);
       break;
     case SCAN_C64_KEY_CTRL:
-      debug_puts("CTRL");
+      debug_puts_P("CTRL");
       _meta = (_meta & ~META_FLAG_CTRL) | (state ? META_FLAG_CTRL: 0);
       break;
+    default:
+      return FALSE;
   }
+  return TRUE;
 }
 
-static void map_function_key(char *unshifted, char *shifted) {
+static void map_function_key(const char *unshifted, const char *shifted) {
   if(!_config) { // don't send in config mode
     if(_meta & META_SHIFT_MASK) {
-      map_ascii_string(shifted);
+      _map_ascii_string_P(shifted);
     } else {
-      map_ascii_string(unshifted);
+      _map_ascii_string_P(unshifted);
     }
   }
 }
@@ -393,35 +635,20 @@ static uint8_t  map_macro(uint8_t key, uint8_t state) {
   if(kbm_find(key | (IS_SHIFTED() ? SW_SHIFT_OVERRIDE : 0), &len, _buf)
                  == KBMRES_SUCCESS) {
     debug_putc(state ? '+' : '-');
-    debug_puts("macro");
+    debug_puts_P("macro");
     if(state) {  // only handle macros on key down.
-      if(_meta & META_FLAG_LSHIFT)
-        set_switch(MAT_PET_KEY_LSHIFT, FALSE);
-      if(_meta & META_FLAG_RSHIFT)
-        set_switch(MAT_PET_KEY_RSHIFT, FALSE);
-
       _debug = TRUE;
       for(i = 0; i < len; i++) {
         override = _buf[i] & SW_SHIFT_OVERRIDE;
         map = _buf[i] & ~SW_SHIFT_OVERRIDE;
 
-        if(map != MAT_PET_KEY_NONE) {
-          if(override)
-            set_switch(MAT_PET_KEY_LSHIFT, TRUE);
-          set_switch(map, TRUE);
-          DELAY_JIFFY();
-          set_switch(map, FALSE);
-          if(override)
-            set_switch(MAT_PET_KEY_LSHIFT, FALSE);
-          DELAY_JIFFY();
-        }
+        if(map != MAT_PET_KEY_NONE)
+          type_key(map, (override ? META_FLAG_LSHIFT : 0));
       }
+      type_end();
       _debug = FALSE;
 
-      if(_meta & META_FLAG_LSHIFT)
-        set_switch(MAT_PET_KEY_LSHIFT, TRUE);
-      if(_meta & META_FLAG_RSHIFT)
-        set_switch(MAT_PET_KEY_RSHIFT, TRUE);
+      plan_restore();
     }
     return TRUE;
   }
@@ -430,12 +657,14 @@ static uint8_t  map_macro(uint8_t key, uint8_t state) {
 
 
 static uint8_t map_key(uint8_t key) {
+  keydef_t def;
   uint8_t state;
-  uint8_t i;
   uint8_t cmp;
+  uint8_t code;
   uint8_t mapped = MAT_PET_KEY_NONE;
 
-  cmp = key & KB_SCAN_CODE_MASK;
+  code = key & KB_SCAN_CODE_MASK;         // with the source keyboard
+  cmp = code & (uint8_t)~KB_SRC_MASK;
   state = (key & KB_KEY_UP ? FALSE : TRUE);
 
   if((cmp == SCAN_C64_KEY_DELETE)
@@ -443,91 +672,292 @@ static uint8_t map_key(uint8_t key) {
      && (_meta & META_FLAG_CBM)
     ) {
     if(!state) { // enter CONFIG mode on key up.
+      release_all();
       _config = !_config;
-      map_ascii_string("config mode on\r");
+      map_ascii_string_P("config mode on\r");
     }
   } else {
     map_meta_key(cmp, state); // map meta keys
-    if(_config || (!_config && !map_macro(cmp, state))) {
-      switch(cmp) {
-      default:
-        for(i = 0; i < MAP_TBL_SZ; i++) {
-          if(key_map[i][1] == cmp) {
-            debug_putc(key_map[i][0]);
-            mapped = set_vkey(key_map[i][2], key_map[i][3], key_map[i][4], state);
-            if(_config)
-              debug_putkey(mapped & SW_VALUE_MASK, state);
-            break;
-          }
+    if(!_config && !state && (code == _rpt_vkey.key)) {
+      mapped = release_repeat();
+    } else if(_config || (!_config && !map_macro(cmp, state))) {
+      get_keydef(cmp, &def);
+      if(def.flags & KEY_FL_MAP) {
+        if(def.ch)
+          debug_putc(def.ch);
+        else
+          debug_puthex(cmp);
+        if(_config && (def.flags & KEY_FL_CFG_SHIFT))
+          def.unshifted |= SW_SHIFT_OVERRIDE;
+        mapped = set_vkey(def.unshifted, def.shifted, def.cmdr, state);
+        if(_config)
+          debug_putkey(mapped & SW_VALUE_MASK, state);
+      } else if((def.flags & KEY_FL_FUNC) && state) {
+        switch(cmp) {
+        case SCAN_C64_KEY_F1:
+          map_function_key(PSTR("directory\r"), PSTR("f2\r"));
+          break;
+        case SCAN_C64_KEY_F3:
+          map_function_key(PSTR("dload \"*\"\r"), PSTR("f4\r"));
+          break;
+        case SCAN_C64_KEY_F5:
+          map_function_key(PSTR("f5\r"), PSTR("f6\r"));
+          break;
+        case SCAN_C64_KEY_F7:
+          map_function_key(PSTR("f7\r"), PSTR("f8\r"));
+          break;
         }
-        break;
-      case SCAN_C64_KEY_DELETE:
-        debug_puts("DELETE");
-        mapped = set_vkey(MAT_PET_KEY_DELETE, MAT_PET_KEY_DELETE, MAT_PET_KEY_NONE, state);
-        break;
-      case SCAN_C64_KEY_RETURN:
-        debug_puts("RETURN");
-        // add shift when in CONFIG mode.
-        mapped = set_vkey(MAT_PET_KEY_RETURN | (_config ? SW_SHIFT_OVERRIDE : 0),
-                          MAT_PET_KEY_RETURN,
-                          MAT_PET_KEY_NONE,
-                          state
-                         );
-        break;
-      case SCAN_C64_KEY_CRSR_RIGHT:
-        debug_puts("CSRT");
-        mapped = set_vkey(MAT_PET_KEY_CRSR_RIGHT, MAT_PET_KEY_CRSR_RIGHT, MAT_PET_KEY_NONE, state);
-        break;
-      case SCAN_C64_KEY_CRSR_DOWN:
-        debug_puts("CSDN");
-        mapped = set_vkey(MAT_PET_KEY_CRSR_DOWN, MAT_PET_KEY_CRSR_DOWN, MAT_PET_KEY_NONE, state);
-        break;
+      }
+      // macros, function keys and modifiers don't repeat.
+      if(state && !_config && _cfg.repeat_rate
+         && ((mapped & SW_VALUE_MASK) != MAT_PET_KEY_NONE)) {
+        _rpt_vkey = _last_vkey;
+        _rpt_vkey.key = code;
+        kb_set_repeat_code(code);
+      }
+    }
+  }
+  return mapped;
+}
 
-      case SCAN_C64_KEY_HOME:
-        debug_puts("HOME");
-        mapped = set_vkey(MAT_PET_KEY_HOME, MAT_PET_KEY_HOME, MAT_PET_KEY_NONE, state);
-        break;
-      case SCAN_C64_KEY_LEFT_ARROW:
-        debug_puts("LEFTARROW");
-        mapped = set_vkey(MAT_PET_KEY_LEFT_ARROW, MAT_PET_KEY_NONE, MAT_PET_KEY_LEFT_ARROW, state);
-        break;
-      case SCAN_C64_KEY_RUN_STOP:
-        debug_puts("RUN/STOP");
-        mapped = set_vkey(MAT_PET_KEY_RUN_STOP, MAT_PET_KEY_RUN_STOP, MAT_PET_KEY_NONE, state);
-        break;
 
-      case SCAN_C64_KEY_F1:
-        mapped = MAT_PET_KEY_NONE;
-        debug_puts("F1");
-        if(state) {
-          map_function_key("directory\r", "f2\r");
-        }
-        break;
-      case SCAN_C64_KEY_F3:
-        mapped = MAT_PET_KEY_NONE;
-        debug_puts("F3");
-        if(state) {
-          map_function_key("dload \"*\"\r", "f4\r");
-        }
-        break;
-      case SCAN_C64_KEY_F5:
-        mapped = MAT_PET_KEY_NONE;
-        debug_puts("F5");
-        if(state) {
-          map_function_key("f5\r", "f6\r");
-        }
-        break;
-      case SCAN_C64_KEY_F7:
-        mapped = MAT_PET_KEY_NONE;
-        debug_puts("F7");
-        if(state) {
-          map_function_key("f7\r", "f8\r");
-        }
-        break;
+#ifdef ISR_TIMING
+static uint16_t _isr_gap;             // longest gap in the spin loop
+static uint16_t _isr_loop = 0xffff;   // shortest, the loop on its own
+
+/*
+ * Wait for a key event with timer 1 running, instead of sleeping.  A gap
+ * between two timer reads longer than the loop itself is an interrupt,
+ * entry and exit included.
+ */
+static void isr_spin(void) {
+  uint16_t t, gap, last;
+  uint8_t avail;
+
+  cycles_start();
+  last = cycles_read();
+  do {
+    avail = kb_data_available();
+    t = cycles_read();
+    gap = t - last;
+    last = t;
+    if(gap > _isr_gap)
+      _isr_gap = gap;
+    if(gap < _isr_loop)
+      _isr_loop = gap;
+  } while(!avail);
+}
+#endif
+
+
+#if defined CONFIG_UART_DEBUG || defined CONFIG_UART_DEBUG_SW || defined ARDUINO_UART_DEBUG
+static void debug_putword(uint16_t data) {
+  debug_puthex(data >> 8);
+  debug_puthex(data & 0xff);
+}
+
+
+#ifdef CYCLE_COUNTER
+// rows of the SRAM key_map key_tbl replaced: char, scan code, 3 PET keys
+#define BENCH_MAP_MAX       64
+
+// the old translation, a search of the key_map rows for the scan code
+static uint8_t __attribute__((noinline))
+bench_search(uint8_t (*map)[5], uint8_t n, uint8_t cmp, keydef_t *def) {
+  uint8_t i;
+
+  for(i = 0; i < n; i++) {
+    if(map[i][1] == cmp) {
+      def->unshifted = map[i][2];
+      def->shifted = map[i][3];
+      def->cmdr = map[i][4];
+      return TRUE;
+    }
+  }
+  return FALSE;
+}
+
+/*
+ * Average and worst cycles to look up a scan code's translation, over
+ * every code: first with a key_map rebuilt from key_tbl in the old
+ * order, by character, then with key_tbl.  The old lookup also went
+ * through a switch for the special keys first; that is not counted.
+ * A clang 14 build in a cycle-counting simulator gives 662/1037 for the
+ * search and 122/122 for key_tbl.
+ */
+static void bench_keydef(void) {
+  uint8_t map[BENCH_MAP_MAX][5];
+  keydef_t def;
+  uint8_t i, j, n, ch;
+  uint16_t t;
+  uint16_t max;
+  uint32_t sum;
+
+  n = 0;
+  for(ch = ' '; ch < 0x7f; ch++) {
+    for(i = 0; i < KB_CODES && n < BENCH_MAP_MAX; i++) {
+      get_keydef(i, &def);
+      if((def.flags & KEY_FL_MAP) && def.ch == ch) {
+        map[n][0] = ch;
+        map[n][1] = i;
+        map[n][2] = def.unshifted;
+        map[n][3] = def.shifted;
+        map[n][4] = def.cmdr;
+        n++;
       }
     }
   }
-  return mapped;
+  debug_puts_P(" xlat:");
+  for(j = 0; j < 2; j++) {
+    sum = 0;
+    max = 0;
+    for(i = 0; i < KB_CODES; i++) {
+      ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+        cycles_start();
+        if(j)
+          get_keydef(i, &def);
+        else
+          bench_search(map, n, i, &def);
+        t = cycles_stop();
+      }
+      sum += t;
+      if(t > max)
+        max = t;
+    }
+    if(j)
+      debug_putc(',');
+    debug_putword(sum / KB_CODES);
+    debug_putc('/');
+    debug_putword(max);
+  }
+}
+
+
+// average and worst cycles to find a row's changed keys, old loop, table
+static void bench_decode(void) {
+  uint16_t cycles[4];
+  uint8_t i;
+
+  kb_bench_decode(cycles);
+  debug_puts_P(" decode:");
+  for(i = 0; i < 4; i++) {
+    if(i)
+      debug_putc(i == 2 ? ',' : '/');
+    debug_putword(cycles[i]);
+  }
+}
+#endif
+
+
+#ifdef ISR_TIMING
+// longest interrupt since the last call, in CPU cycles
+static uint16_t isr_worst(void) {
+  uint16_t t = (_isr_gap > _isr_loop ? _isr_gap - _isr_loop : 0);
+
+  _isr_gap = 0;
+  return t;
+}
+#endif
+
+
+static void print_stats(void) {
+  // queue high water mark and drops, then ghost key rejections
+  debug_puts_P("kbq:");
+  debug_puthex(kb_get_rx_hiwater());
+  debug_putc('/');
+  debug_putword(kb_get_rx_drops());
+#ifdef KB_GHOST_FILTER
+  debug_puts_P(" ghost:");
+  debug_putword(kb_get_ghost_count());
+#endif
+  debug_puts_P(" outq:");
+  debug_puthex(xptq_get_hiwater());
+  debug_putc('/');
+  debug_putword(xptq_get_drops());
+  debug_puts_P(" saved:");
+  debug_putword(xptq_get_saved());
+#ifdef ISR_TIMING
+  // before the benches, which stop timer 1
+  debug_puts_P(" isr:");
+  debug_putword(isr_worst());
+#endif
+#ifdef CYCLE_COUNTER
+  bench_keydef();
+  bench_decode();
+#endif
+  debug_putcrlf();
+}
+#endif
+
+
+// returns 0-9 for the number keys, else 0xff
+static uint8_t scan_to_digit(uint8_t cmp) {
+  keydef_t def;
+
+  get_keydef(cmp, &def);
+  if((def.flags & KEY_FL_MAP) && def.ch >= '0' && def.ch <= '9')
+    return def.ch - '0';
+  return 0xff;
+}
+
+
+#ifdef JOYSTICK
+// unshifted PET switch for a scan code, as map_key() would close it
+static uint8_t scan_to_vkey(uint8_t cmp) {
+  keydef_t def;
+
+  // the shift keys are modifiers, not in the table
+  if(cmp == SCAN_C64_KEY_LSHIFT)
+    return MAT_PET_KEY_LSHIFT;
+  if(cmp == SCAN_C64_KEY_RSHIFT)
+    return MAT_PET_KEY_RSHIFT;
+  get_keydef(cmp, &def);
+  if(def.flags & KEY_FL_MAP)
+    return def.unshifted & SW_VALUE_MASK;
+  return MAT_PET_KEY_NONE;
+}
+
+
+// hand joystick port's keys to the scan interrupt
+static void set_joy(uint8_t port) {
+  uint8_t line;
+  uint8_t vkey;
+
+  for(line = 0; line < JOY_LINES; line++) {
+    vkey = MAT_PET_KEY_NONE;
+    if(_cfg.joy_keys[port][line] != JOY_KEY_NONE)
+      vkey = scan_to_vkey(_cfg.joy_keys[port][line]);
+    joy_set_map(port, line, (vkey == MAT_PET_KEY_NONE ? JOY_NO_SWITCH : vkey));
+  }
+}
+
+
+// each shot is held at least the pace hold, so the PET sees it
+static void set_autofire(uint8_t port) {
+  uint8_t rate = _cfg.autofire[port];
+
+  joy_set_autofire(port, (rate ? pgm_read_byte(&autofire_hz[rate - 1]) : 0),
+                   _pace.hold);
+}
+
+
+static void set_autofire_all(void) {
+  uint8_t port;
+
+  for(port = 0; port < JOY_PORTS; port++)
+    set_autofire(port);
+}
+#else
+#  define set_joy(port)       do {} while(0)
+#  define set_autofire(port)  do {} while(0)
+#  define set_autofire_all()  do {} while(0)
+#endif
+
+
+// show a key in config mode without leaving it down
+static void echo_key(uint8_t cmp) {
+  map_key(cmp);
+  map_key(cmp | KB_KEY_UP);
 }
 
 
@@ -535,14 +965,16 @@ void map_option(uint8_t key) {
   uint8_t state;
   uint8_t cmp;
   uint8_t vkey;
+  uint8_t num;
 
-  cmp = key & KB_SCAN_CODE_MASK;
+  cmp = key & KB_SCAN_CODE_MASK & (uint8_t)~KB_SRC_MASK;
   state = (key & KB_KEY_UP ? FALSE : TRUE);
   //override = (_meta & META_SHIFT_MASK ? SW_SHIFT_OVERRIDE : 0);
 
   map_meta_key(cmp, state); // handle meta keys
   if(!state && (_meta & META_FLAG_CTRL) && (_meta & META_FLAG_CBM) && (cmp == SCAN_C64_KEY_DELETE)) {
-    map_ascii_string("config mode off\r");
+    release_all();
+    map_ascii_string_P("config mode off\r");
     _config = !_config;
     // TODO save state, most likely
   } else {
@@ -553,39 +985,41 @@ void map_option(uint8_t key) {
           switch(cmp) {
             case SCAN_C64_KEY_J:
               _opt_state = OPTST_MAP_JOY;
-              map_ascii_string("map joystick. joy#");
+              map_ascii_string_P("map joystick. joy#");
               break;
             case SCAN_C64_KEY_F1:
-              _opt_state = OPTST_MAP_KEY_DATA;
-              _opt_num = 0;
-              map_ascii_string("map function key (sh-return to finish) #");
-              map_ascii_key(IS_SHIFTED() ? '2' : '1');
-              map_ascii_key(':');
-              break;
             case SCAN_C64_KEY_F3:
-              _opt_state = OPTST_MAP_KEY_DATA;
-              _opt_num = 0;
-              map_ascii_string("map function key (sh-return to finish) #");
-              map_ascii_key(IS_SHIFTED() ? '4' : '3');
-              map_ascii_key(':');
-              break;
             case SCAN_C64_KEY_F5:
-              _opt_state = OPTST_MAP_KEY_DATA;
-              _opt_num = 0;
-              map_ascii_string("map function key (sh-return to finish) #");
-              map_ascii_key(IS_SHIFTED() ? '6' : '5');
-              map_ascii_key(':');
-              break;
             case SCAN_C64_KEY_F7:
               _opt_state = OPTST_MAP_KEY_DATA;
               _opt_num = 0;
-              map_ascii_string("map function key (sh-return to finish) #");
-              map_ascii_key(IS_SHIFTED() ? '8' : '7');
+              map_ascii_string_P("map function key (sh-return to finish) #");
+              num = (cmp == SCAN_C64_KEY_F1 ? '1'
+                     : cmp == SCAN_C64_KEY_F3 ? '3'
+                     : cmp == SCAN_C64_KEY_F5 ? '5' : '7');
+              map_ascii_key(num + (IS_SHIFTED() ? 1 : 0));
               map_ascii_key(':');
               break;
             case SCAN_C64_KEY_M: // map a key
               _opt_state = OPTST_MAP_KEY;
-              map_ascii_string("map which key?:");
+              map_ascii_string_P("map which key?:");
+              break;
+#if defined CONFIG_UART_DEBUG || defined CONFIG_UART_DEBUG_SW || defined ARDUINO_UART_DEBUG
+            case SCAN_C64_KEY_S: // statistics, to debug port
+              print_stats();
+              break;
+#endif
+            case SCAN_C64_KEY_A: // joystick autofire
+              _opt_state = OPTST_AUTOFIRE_JOY;
+              map_ascii_string_P("autofire. joy#");
+              break;
+            case SCAN_C64_KEY_R: // key repeat
+              _opt_state = OPTST_REPEAT_RATE;
+              map_ascii_string_P("repeat rate (0=off,1-9):");
+              break;
+            case SCAN_C64_KEY_P: // output pacing
+              _opt_state = OPTST_PACE;
+              map_ascii_string_P("pet (0=50hz,1=60hz 1st rom,2=60hz,3=50hz 1st rom):");
               break;
           }
           break;
@@ -596,7 +1030,7 @@ void map_option(uint8_t key) {
             case SCAN_C64_KEY_CBM:
             case SCAN_C64_KEY_CTRL:
               // ignore.
-              map_ascii_string("invalid\r");
+              _map_ascii_string_P(str_invalid);
               _opt_state = OPTST_IDLE;
               break;
             default:
@@ -604,64 +1038,137 @@ void map_option(uint8_t key) {
               _opt_state = OPTST_MAP_KEY_DATA;
               _opt_num = 0;
               map_key(key);
-              map_ascii_string(" (sh-return to finish):");
+              map_ascii_string_P(" (sh-return to finish):");
               break;
           }
           break;
+        case OPTST_REPEAT_RATE:
+          num = scan_to_digit(cmp);
+          if(num > 9) {
+            _map_ascii_string_P(str_invalid);
+            _opt_state = OPTST_IDLE;
+          } else {
+            map_ascii_key('0' + num);
+            _cfg.repeat_rate = num;
+            if(num) {
+              map_ascii_string_P(" delay (1-9 x100ms):");
+              _opt_state = OPTST_REPEAT_DELAY;
+            } else {
+              set_repeat();
+              write_configuration(&_cfg);
+              map_ascii_key(13);
+              _opt_state = OPTST_IDLE;
+            }
+          }
+          break;
+        case OPTST_REPEAT_DELAY:
+          num = scan_to_digit(cmp);
+          if(num < 1 || num > 9) {
+            _map_ascii_string_P(str_invalid);
+          } else {
+            map_ascii_key('0' + num);
+            _cfg.repeat_delay = num;
+            set_repeat();
+            write_configuration(&_cfg);
+            map_ascii_key(13);
+          }
+          _opt_state = OPTST_IDLE;
+          break;
+        case OPTST_AUTOFIRE_JOY:
+          num = scan_to_digit(cmp);
+          if(num < 1 || num > 2) {
+            _map_ascii_string_P(str_invalid_dot);
+            _opt_state = OPTST_IDLE;
+          } else {
+            map_ascii_key('0' + num);
+            map_ascii_string_P(" rate (0=off,1-9):");
+            _opt_num = num - 1;
+            _opt_state = OPTST_AUTOFIRE_RATE;
+          }
+          break;
+        case OPTST_AUTOFIRE_RATE:
+          num = scan_to_digit(cmp);
+          if(num > 9) {
+            _map_ascii_string_P(str_invalid);
+          } else {
+            map_ascii_key('0' + num);
+            _cfg.autofire[_opt_num] = num;
+            set_autofire(_opt_num);
+            write_configuration(&_cfg);
+            map_ascii_key(13);
+          }
+          _opt_state = OPTST_IDLE;
+          break;
+        case OPTST_PACE:
+          num = scan_to_digit(cmp);
+          if(num >= PACE_TBL_SZ) {
+            _map_ascii_string_P(str_invalid);
+          } else {
+            map_ascii_key('0' + num);
+            _cfg.pace = num;
+            set_pace();
+            set_autofire_all();
+            write_configuration(&_cfg);
+            map_ascii_key(13);
+          }
+          _opt_state = OPTST_IDLE;
+          break;
         case OPTST_DEBUG:
           break;
         case OPTST_MAP_JOY:
           switch(cmp) {
             case SCAN_C64_KEY_1:
-              map_ascii_string("1.up:");
+              map_ascii_string_P("1.up:");
               _opt_state = OPTST_JOYUP;
               _opt_num = 0;
               break;
             case SCAN_C64_KEY_2:
-              map_ascii_string("2.up:");
+              map_ascii_string_P("2.up:");
               _opt_state = OPTST_JOYUP;
               _opt_num = 1;
               break;
             default:
-              map_ascii_string(".INVALID\r");
+              _map_ascii_string_P(str_invalid_dot);
               _opt_state = OPTST_IDLE;
               break;
           }
           break;
         case OPTST_JOYUP:
-          map_key(cmp);
-          _joy_keys[_opt_num][JOY_UP] = cmp;
-          map_ascii_string(".down:");
+          echo_key(cmp);
+          _cfg.joy_keys[_opt_num][JOY_UP] = cmp;
+          map_ascii_string_P(".down:");
           _opt_state = OPTST_JOYDN;
           break;
         case OPTST_JOYDN:
-          map_key(cmp);
-          _joy_keys[_opt_num][JOY_DN] = cmp;
-          map_ascii_string(".left:");
+          echo_key(cmp);
+          _cfg.joy_keys[_opt_num][JOY_DN] = cmp;
+          map_ascii_string_P(".left:");
           _opt_state = OPTST_JOYLT;
           break;
         case OPTST_JOYLT:
-          map_key(cmp);
-          _joy_keys[_opt_num][JOY_LT] = cmp;
-          map_ascii_string(".right:");
+          echo_key(cmp);
+          _cfg.joy_keys[_opt_num][JOY_LT] = cmp;
+          map_ascii_string_P(".right:");
           _opt_state = OPTST_JOYRT;
           break;
         case OPTST_JOYRT:
-          map_key(cmp);
-          _joy_keys[_opt_num][JOY_RT] = cmp;
-          map_ascii_string(".fire 1:");
+          echo_key(cmp);
+          _cfg.joy_keys[_opt_num][JOY_RT] = cmp;
+          map_ascii_string_P(".fire 1:");
           _opt_state = OPTST_JOYF1;
           break;
         case OPTST_JOYF1:
-          map_key(cmp);
-          _joy_keys[_opt_num][JOY_F1] = cmp;
-          map_ascii_string(".fire 2:");
+          echo_key(cmp);
+          _cfg.joy_keys[_opt_num][JOY_F1] = cmp;
+          map_ascii_string_P(".fire 2:");
           _opt_state = OPTST_JOYF2;
           break;
         case OPTST_JOYF2:
-          map_key(cmp);
-          _joy_keys[_opt_num][JOY_F2] = cmp;
-          map_ascii_string(".mapped\r");
+          echo_key(cmp);
+          _cfg.joy_keys[_opt_num][JOY_F2] = cmp;
+          set_joy(_opt_num);
+          write_configuration(&_cfg);
+          map_ascii_string_P(".mapped\r");
           _opt_state = OPTST_IDLE;
           break;
         default:
@@ -676,8 +1183,10 @@ void map_option(uint8_t key) {
           kbm_del(_key); // delete old mapping;
           //debug_trace(_buf,0,_opt_num);
           //debug_puthex(_key);
-          kbm_add(_key, _opt_num, _buf);
-          map_ascii_string("mapped\r");
+          if(kbm_add(_key, _opt_num, _buf) == KBMRES_SUCCESS)
+            map_ascii_string_P("mapped\r");
+          else
+            map_ascii_string_P("no room\r");
         } else {
           switch(cmp) {
             case SCAN_C64_KEY_LSHIFT:
@@ -691,8 +1200,12 @@ void map_option(uint8_t key) {
               vkey = map_key(key);
               debug_putkey(vkey, state);
               //_debug = FALSE;
-              if(state) // if key down.
-                _buf[_opt_num++] = vkey;
+              if(state) { // if key down.
+                if(_opt_num < sizeof(_buf))
+                  _buf[_opt_num++] = vkey;
+                else
+                  debug_puts_P("macro full");
+              }
               break;
           }
         }
@@ -705,19 +1218,79 @@ void map_option(uint8_t key) {
 
 
 void vkb_init(void) {
+#ifdef JOYSTICK
+  uint8_t i;
+
+#endif
   kb_init();
   xpt_init();
+  xptq_init();
+  joy_init();
+  set_sleep_mode(SLEEP_MODE_IDLE);
+  _rpt_vkey.key = KB_NO_REPEAT;
+  _cfg.repeat_rate = REPEAT_RATE_DEFAULT;
+  _cfg.repeat_delay = REPEAT_DELAY_DEFAULT;
+  _cfg.pace = PACE_DEFAULT;
+  memset(_cfg.joy_keys, JOY_KEY_NONE, sizeof(_cfg.joy_keys));
+  read_configuration(&_cfg);
+  if(_cfg.repeat_rate > 9 || _cfg.repeat_delay < 1 || _cfg.repeat_delay > 9) {
+    _cfg.repeat_rate = REPEAT_RATE_DEFAULT;
+    _cfg.repeat_delay = REPEAT_DELAY_DEFAULT;
+  }
+  set_repeat();
+  if(_cfg.pace >= PACE_TBL_SZ)
+    _cfg.pace = PACE_DEFAULT;
+  set_pace();
+#ifdef JOYSTICK
+  for(i = 0; i < JOY_PORTS; i++) {
+    if(_cfg.autofire[i] > 9)
+      _cfg.autofire[i] = 0;
+    set_joy(i);
+    set_autofire(i);
+  }
+#endif
 }
 
 
 void vkb_scan(void) {
   uint8_t key;
+#ifdef KB_IDLE_PASSES
+  uint8_t ms;
+#endif
 
   for(;;) {
-    if(kb_data_available() != 0) {
+    // nothing to do until the next interrupt, which also drains the
+    // output queue.
+    cli();
+    if(!kb_data_available() || xptq_get_free() < EVENT_XPT_MAX) {
+#ifdef ISR_TIMING
+      sei();
+      isr_spin();
+#else
+      sleep_enable();
+      sei();
+      sleep_cpu();
+      sleep_disable();
+#endif
+    }
+    sei();
+#ifdef KB_IDLE_PASSES
+    ms = kb_get_wake_latency();
+    if(ms != KB_NO_LATENCY) {
+      debug_puts_P("wake:");
+      debug_puthex(ms);
+      debug_putcrlf();
+    }
+#endif
+    if(kb_data_available() != 0 && xptq_get_free() >= EVENT_XPT_MAX) {
       // kb sent data...
       key=kb_recv();
-      if(_config)
+#if KB_SOURCES > 1
+      _src = KB_SRC(key);
+#endif
+      if(is_repeat(key))
+        map_repeat(key);
+      else if(_config)
         map_option(key);
       else
         map_key(key);
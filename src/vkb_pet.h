@@ -43,97 +43,8 @@ typedef enum {
 
 
 
-#define MAT_PET_KEY_EQUALS        MATRIX_MAP(0,0)
-#define MAT_PET_KEY_PERIOD        MATRIX_MAP(0,1)
-
-#define MAT_PET_KEY_NONE          MATRIX_MAP(0,2)
-
-#define MAT_PET_KEY_RUN_STOP      MATRIX_MAP(0,3)
-#define MAT_PET_KEY_LESS_THAN     MATRIX_MAP(0,4)
-#define MAT_PET_KEY_SPACE         MATRIX_MAP(0,5)
-#define MAT_PET_KEY_LEFT_BRACKET  MATRIX_MAP(0,6)
-#define MAT_PET_KEY_REVERSE       MATRIX_MAP(0,7)
-
-#define MAT_PET_KEY_MINUS         MATRIX_MAP(1,0)
-#define MAT_PET_KEY_0             MATRIX_MAP(1,1)
-#define MAT_PET_KEY_RSHIFT        MATRIX_MAP(1,2)
-#define MAT_PET_KEY_GREATER_THAN  MATRIX_MAP(1,3)
-
-#define MAT_PET_KEY_RIGHT_BRACKET MATRIX_MAP(1,5)
-#define MAT_PET_KEY_AT            MATRIX_MAP(1,6)
-#define MAT_PET_KEY_LSHIFT        MATRIX_MAP(1,7)
-
-#define MAT_PET_KEY_PLUS          MATRIX_MAP(2,0)
-#define MAT_PET_KEY_2             MATRIX_MAP(2,1)
-
-#define MAT_PET_KEY_QUESTION_MARK MATRIX_MAP(2,3)
-#define MAT_PET_KEY_COMMA         MATRIX_MAP(2,4)
-#define MAT_PET_KEY_N             MATRIX_MAP(2,5)
-#define MAT_PET_KEY_V             MATRIX_MAP(2,6)
-#define MAT_PET_KEY_X             MATRIX_MAP(2,7)
-
-#define MAT_PET_KEY_3             MATRIX_MAP(3,0)
-#define MAT_PET_KEY_1             MATRIX_MAP(3,1)
-#define MAT_PET_KEY_RETURN        MATRIX_MAP(3,2)
-#define MAT_PET_KEY_SEMICOLON     MATRIX_MAP(3,3)
-#define MAT_PET_KEY_M             MATRIX_MAP(3,4)
-#define MAT_PET_KEY_B             MATRIX_MAP(3,5)
-#define MAT_PET_KEY_C             MATRIX_MAP(3,6)
-#define MAT_PET_KEY_Z             MATRIX_MAP(3,7)
-
-#define MAT_PET_KEY_ASTERIX       MATRIX_MAP(4,0)
-#define MAT_PET_KEY_5             MATRIX_MAP(4,1)
-
-#define MAT_PET_KEY_COLON         MATRIX_MAP(4,3)
-#define MAT_PET_KEY_K             MATRIX_MAP(4,4)
-#define MAT_PET_KEY_H             MATRIX_MAP(4,5)
-#define MAT_PET_KEY_F             MATRIX_MAP(4,6)
-#define MAT_PET_KEY_S             MATRIX_MAP(4,7)
-
-#define MAT_PET_KEY_6             MATRIX_MAP(5,0)
-#define MAT_PET_KEY_4             MATRIX_MAP(5,1)
-
-#define MAT_PET_KEY_L             MATRIX_MAP(5,3)
-#define MAT_PET_KEY_J             MATRIX_MAP(5,4)
-#define MAT_PET_KEY_G             MATRIX_MAP(5,5)
-#define MAT_PET_KEY_D             MATRIX_MAP(5,6)
-#define MAT_PET_KEY_A             MATRIX_MAP(5,7)
-
-#define MAT_PET_KEY_SLASH         MATRIX_MAP(6,0)
-#define MAT_PET_KEY_8             MATRIX_MAP(6,1)
-
-#define MAT_PET_KEY_P             MATRIX_MAP(6,3)
-#define MAT_PET_KEY_I             MATRIX_MAP(6,4)
-#define MAT_PET_KEY_Y             MATRIX_MAP(6,5)
-#define MAT_PET_KEY_R             MATRIX_MAP(6,6)
-#define MAT_PET_KEY_W            MATRIX_MAP(6,7)
-
-#define MAT_PET_KEY_9            MATRIX_MAP(7,0)
-#define MAT_PET_KEY_7            MATRIX_MAP(7,1)
-#define MAT_PET_KEY_UP_ARROW     MATRIX_MAP(7,2)
-#define MAT_PET_KEY_O            MATRIX_MAP(7,3)
-#define MAT_PET_KEY_U            MATRIX_MAP(7,4)
-#define MAT_PET_KEY_T            MATRIX_MAP(7,5)
-#define MAT_PET_KEY_E            MATRIX_MAP(7,6)
-#define MAT_PET_KEY_Q            MATRIX_MAP(7,7)
-
-#define MAT_PET_KEY_DELETE       MATRIX_MAP(8,0)
-#define MAT_PET_KEY_CRSR_DOWN    MATRIX_MAP(8,1)
-
-#define MAT_PET_KEY_RIGHT_PAREN  MATRIX_MAP(8,3)
-#define MAT_PET_KEY_BACKSLASH    MATRIX_MAP(8,4)
-#define MAT_PET_KEY_APOSTROPHE   MATRIX_MAP(8,5)
-#define MAT_PET_KEY_DOLLAR_SIGN  MATRIX_MAP(8,6)
-#define MAT_PET_KEY_DOUBLE_QUOTE MATRIX_MAP(8,7)
-
-#define MAT_PET_KEY_CRSR_RIGHT   MATRIX_MAP(9,0)
-#define MAT_PET_KEY_HOME         MATRIX_MAP(9,1)
-#define MAT_PET_KEY_LEFT_ARROW   MATRIX_MAP(9,2)
-#define MAT_PET_KEY_LEFT_PAREN   MATRIX_MAP(9,3)
-#define MAT_PET_KEY_AMPERSAND    MATRIX_MAP(9,4)
-#define MAT_PET_KEY_PERCENT      MATRIX_MAP(9,5)
-#define MAT_PET_KEY_HASH         MATRIX_MAP(9,6)
-#define MAT_PET_KEY_EXCLAMATION  MATRIX_MAP(9,7)
+// MAT_PET_KEY_*, generated from the key mapping CSV
+#include "keymap.h"
 
 #define SCAN_C64_KEY_DELETE      SCAN_MAP(0,0)
 #define SCAN_C64_KEY_RETURN      SCAN_MAP(0,1)
@@ -207,4 +118,33 @@ typedef enum {
 #define SCAN_C64_KEY_Q           SCAN_MAP(7,6)
 #define SCAN_C64_KEY_RUN_STOP    SCAN_MAP(7,7)
 
+#ifdef KB_C128
+#define SCAN_C128_KEY_HELP       SCAN_MAP_K(0,0)
+#define SCAN_C128_KEY_KP_8       SCAN_MAP_K(0,1)
+#define SCAN_C128_KEY_KP_5       SCAN_MAP_K(0,2)
+#define SCAN_C128_KEY_TAB        SCAN_MAP_K(0,3)
+#define SCAN_C128_KEY_KP_2       SCAN_MAP_K(0,4)
+#define SCAN_C128_KEY_KP_4       SCAN_MAP_K(0,5)
+#define SCAN_C128_KEY_KP_7       SCAN_MAP_K(0,6)
+#define SCAN_C128_KEY_KP_1       SCAN_MAP_K(0,7)
+
+#define SCAN_C128_KEY_ESC        SCAN_MAP_K(1,0)
+#define SCAN_C128_KEY_KP_PLUS    SCAN_MAP_K(1,1)
+#define SCAN_C128_KEY_KP_MINUS   SCAN_MAP_K(1,2)
+#define SCAN_C128_KEY_LINE_FEED  SCAN_MAP_K(1,3)
+#define SCAN_C128_KEY_ENTER      SCAN_MAP_K(1,4)
+#define SCAN_C128_KEY_KP_6       SCAN_MAP_K(1,5)
+#define SCAN_C128_KEY_KP_9       SCAN_MAP_K(1,6)
+#define SCAN_C128_KEY_KP_3       SCAN_MAP_K(1,7)
+
+#define SCAN_C128_KEY_ALT        SCAN_MAP_K(2,0)
+#define SCAN_C128_KEY_KP_0       SCAN_MAP_K(2,1)
+#define SCAN_C128_KEY_KP_PERIOD  SCAN_MAP_K(2,2)
+#define SCAN_C128_KEY_CRSR_UP    SCAN_MAP_K(2,3)
+#define SCAN_C128_KEY_CRSR_DOWN  SCAN_MAP_K(2,4)
+#define SCAN_C128_KEY_CRSR_LEFT  SCAN_MAP_K(2,5)
+#define SCAN_C128_KEY_CRSR_RIGHT SCAN_MAP_K(2,6)
+#define SCAN_C128_KEY_NO_SCROLL  SCAN_MAP_K(2,7)
+#endif
+
 #endif //VKB_PET_H
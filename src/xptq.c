@@ -0,0 +1,321 @@
+/*
+ *  PETKey - VIC/64 to PET keyboard adapter
+ *  Copyright (C) 2021 Jim Brain and RETRO Innovations <go4retro@go4retro.com>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; version 2 of the License only.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ *  xptq.c: Timed crosspoint output queue
+ *
+ *  Switch changes are queued with the scan tick they may happen at, and
+ *  the scan interrupt makes them once that tick comes.  Typing a string
+ *  or a macro queues all of it and returns, so the main loop keeps
+ *  reading the keyboard while the PET is fed at its own pace.  A change
+ *  with nothing queued ahead of it and no delay pending goes straight out.
+ *  The queue never waits for room: a change that does not fit is dropped
+ *  and counted, so callers check xptq_get_free() before they start.
+ *
+ *  A shadow of the 128 switches skips writes that would change nothing.
+ *  The joysticks close switches of their own, straight from the scan
+ *  interrupt.  A switch stays closed while either the keyboard side or a
+ *  joystick holds it, so neither can open one the other still needs.
+ *
+ *  With PET_SYNC the clock counts PET keyboard scans instead of scan
+ *  ticks, from the row line the PET scans last.  Changes are made right
+ *  after a scan, so each one is seen whole by the next, and a key held
+ *  one scan has been seen once.  One row line does for all keys, as the
+ *  ROM takes at most one new key a scan.  If the PET stops scanning, the
+ *  clock runs on from the scan ticks, a scan longer than a 50 Hz jiffy.
+ */
+
+#include <avr/io.h>
+#include <inttypes.h>
+#include <string.h>
+#include <util/atomic.h>
+
+#include "config.h"
+#include "kb.h"
+#include "ring.h"
+#include "xptq.h"
+
+#define XPTQ_CLOSE            0x80   /* switch numbers are 7 bits */
+// with more switches closed, release all with a reset pulse
+#define XPTQ_RESET_MIN        8
+// delays never reach this far ahead, a time further out wrapped long ago
+#define XPTQ_STALE            0x4000
+
+#ifdef PET_SYNC
+// a 60 Hz jiffy, delays are turned into PET scans with it
+#  define XPTQ_SCAN_TICKS     KB_MS_TO_TICKS(1000/60)
+// scan ticks without a PET scan before the clock runs on its own
+#  define XPTQ_SYNC_LOST      KB_MS_TO_TICKS(100)
+// its scans then, longer than a 50 Hz jiffy so any PET sees each change
+#  define XPTQ_OWN_SCAN       KB_MS_TO_TICKS_UP(1000/50 + 1)
+#endif
+
+typedef struct {
+  uint8_t  sw;            // switch, XPTQ_CLOSE to close it
+  uint16_t time;          // not before this clock value
+} xptq_event_t;
+
+RING_DEFINE(xptq_ring, xptq_event_t, XPTQ_SHIFT)
+
+static xptq_ring_t      xptq;
+static uint16_t         xptq_time;    // not-before tick for the next change
+static uint8_t          xptq_shadow[16];        // 1 = switch closed
+#ifdef JOYSTICK
+static uint8_t          xptq_keys[16];  // closed for the keyboard side
+static uint8_t          xptq_held[16];  // closed for the joysticks
+#endif
+static volatile uint16_t xptq_saved;    // crosspoint writes skipped
+#ifdef PET_SYNC
+static volatile uint16_t xptq_scans;    // PET scans, the clock
+static uint8_t          xptq_lost;    // scan ticks since the last PET scan
+#endif
+
+static uint16_t xptq_now(void) {
+#ifdef PET_SYNC
+  uint16_t scans;
+
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+    scans = xptq_scans;
+  }
+  return scans;
+#else
+  return kb_get_ticks();
+#endif
+}
+
+static void xptq_count_saved(uint8_t n) {
+  uint16_t s = xptq_saved + n;
+
+  xptq_saved = (s < xptq_saved ? 0xffff : s);
+}
+
+// set a switch unless it is in that state already, interrupts off
+static void xptq_set(uint8_t sw, uint8_t state) {
+  uint8_t *p = &xptq_shadow[sw >> 3];
+  uint8_t bit = _BV(sw & 7);
+
+  if(!(*p & bit) == !state) {
+    xptq_count_saved(1);
+    return;
+  }
+  *p ^= bit;
+  xpt_send(sw, state);
+}
+
+#ifdef JOYSTICK
+// set sw in one owner's mask, then the switch to what all owners want
+static void xptq_own(uint8_t *mask, uint8_t sw, uint8_t state) {
+  uint8_t i = sw >> 3;
+  uint8_t bit = _BV(sw & 7);
+
+  if(state)
+    mask[i] |= bit;
+  else
+    mask[i] &= (uint8_t)~bit;
+  xptq_set(sw, (xptq_keys[i] | xptq_held[i]) & bit);
+}
+
+// a joystick's switch, from the scan interrupt
+void xptq_hold(uint8_t sw, uint8_t state) {
+  xptq_own(xptq_held, sw, state);
+}
+#endif
+
+// the keyboard side's switch, interrupts off
+void xptq_write(uint8_t sw, uint8_t state) {
+#ifdef JOYSTICK
+  xptq_own(xptq_keys, sw, state);
+#else
+  xptq_set(sw, state);
+#endif
+}
+
+static uint8_t xptq_count(const uint8_t *mask) {
+  uint8_t i, j;
+  uint8_t n = 0;
+
+  for(i = 0; i < sizeof(xptq_shadow); i++) {
+    for(j = mask[i]; j; j &= j - 1)
+      n++;
+  }
+  return n;
+}
+
+// drop queued changes and open every switch the keyboard side closed
+void xptq_release_all(void) {
+  uint8_t i, j, want, diff;
+  uint8_t n, held = 0;
+
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+    xptq_ring_flush(&xptq);
+    xptq_time = xptq_now();
+#ifdef JOYSTICK
+    memset(xptq_keys, 0, sizeof(xptq_keys));
+    held = xptq_count(xptq_held);
+#endif
+    n = xptq_count(xptq_shadow) - held;
+    // the reset opens the joysticks' switches, too, they close again
+    if(n > XPTQ_RESET_MIN + held) {
+      xpt_reset();
+      memset(xptq_shadow, 0, sizeof(xptq_shadow));
+      xptq_count_saved(n - 1 - held);
+    }
+    for(i = 0; i < sizeof(xptq_shadow); i++) {
+#ifdef JOYSTICK
+      want = xptq_held[i];
+#else
+      want = 0;
+#endif
+      diff = xptq_shadow[i] ^ want;
+      for(j = 0; diff; j++) {
+        if(diff & _BV(j)) {
+          diff &= (uint8_t)~_BV(j);
+          xptq_set((i << 3) | j, want & _BV(j));
+        }
+      }
+    }
+  }
+}
+
+// TRUE once xptq_time has passed, idle queue only
+static uint8_t xptq_due(uint16_t now) {
+  return (uint16_t)(xptq_time - now - 1) >= XPTQ_STALE;
+}
+
+// returns FALSE if the queue is full and the change was dropped
+uint8_t xptq_put(uint8_t sw, uint8_t state) {
+  xptq_event_t ev;
+  uint8_t rc = TRUE;
+
+  ev.sw = sw | (state ? XPTQ_CLOSE : 0);
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+    if(xptq_ring_empty(&xptq) && xptq_due(xptq_now())) {
+#ifdef PET_SYNC
+      xptq_time = xptq_now() + 1;  // right after the next PET scan
+#else
+      xptq_write(sw, state);
+      xptq_time = kb_get_ticks();  // delays count from here
+      return rc;
+#endif
+    }
+    ev.time = xptq_time;
+    rc = xptq_ring_put(&xptq, ev);
+  }
+  return rc;
+}
+
+/*
+ * Hold off the next change for ticks after the last one.  Time already
+ * gone since a change sent at once counts, so a delay after a change
+ * long past costs nothing.
+ */
+void xptq_delay(uint16_t ticks) {
+  uint16_t now = xptq_now();
+
+#ifdef PET_SYNC
+  // in PET scans.  Changes are made between two scans, so a delay shorter
+  // than one needs none, unless the clock runs on its own.
+  ticks /= XPTQ_SCAN_TICKS;
+  if(!ticks && xptq_lost >= XPTQ_SYNC_LOST)
+    ticks = 1;
+#endif
+
+  if(xptq_ring_empty(&xptq) && xptq_due(now)
+     && (uint16_t)(now - xptq_time) >= ticks)
+    xptq_time = now;
+  else
+    xptq_time += ticks;
+}
+
+uint8_t xptq_get_hiwater(void) {
+  return xptq_ring_hiwater(&xptq);
+}
+
+uint8_t xptq_get_free(void) {
+  return xptq_ring_free(&xptq);
+}
+
+uint16_t xptq_get_drops(void) {
+  uint16_t drops;
+
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+    drops = xptq.drops;
+  }
+  return drops;
+}
+
+uint16_t xptq_get_saved(void) {
+  uint16_t saved;
+
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+    saved = xptq_saved;
+  }
+  return saved;
+}
+
+static void xptq_drain(void) {
+  xptq_event_t ev;
+  uint16_t now;
+
+  if(xptq_ring_empty(&xptq))
+    return;
+  now = xptq_now();
+  do {
+    ev = xptq_ring_peek(&xptq);
+    if((int16_t)(now - ev.time) < 0) {
+      // more to come, keep the scan tick at full rate
+      kb_keep_awake();
+      return;
+    }
+    xptq_ring_get(&xptq);
+    xptq_write(ev.sw & (uint8_t)~XPTQ_CLOSE, ev.sw & XPTQ_CLOSE);
+  } while(!xptq_ring_empty(&xptq));
+}
+
+// called from the scan interrupt, every scan tick
+void xptq_run(void) {
+#ifdef PET_SYNC
+  if(xptq_lost < XPTQ_SYNC_LOST) {
+    xptq_lost++;
+    if(!xptq_ring_empty(&xptq))
+      kb_keep_awake();  // keep counting while changes wait
+    return;
+  }
+  xptq_lost -= XPTQ_OWN_SCAN;         // no PET scans, make our own
+  xptq_scans++;
+#endif
+  xptq_drain();
+}
+
+#ifdef PET_SYNC
+// called from the PET row line interrupt, the PET has just read the row
+void xptq_sync(void) {
+  xptq_lost = 0;
+  xptq_scans++;
+  xptq_drain();
+}
+#endif
+
+void xptq_init(void) {
+  xptq_ring_init(&xptq);
+  memset(xptq_shadow, 0, sizeof(xptq_shadow));   // xpt_init() reset them
+#ifdef JOYSTICK
+  memset(xptq_keys, 0, sizeof(xptq_keys));
+  memset(xptq_held, 0, sizeof(xptq_held));
+#endif
+  xptq_time = xptq_now();
+  pet_sync_init();
+}
@@ -0,0 +1,42 @@
+/*
+ *  PETKey - VIC/64 to PET keyboard adapter
+ *  Copyright (C) 2021 Jim Brain and RETRO Innovations <go4retro@go4retro.com>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; version 2 of the License only.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ *  xptq.h: Definitions for the timed crosspoint output queue
+ */
+
+#ifndef XPTQ_H
+#define XPTQ_H
+
+// 3 bytes an entry, 768 at 8.  vkb_pet.c waits for EVENT_XPT_MAX (196)
+// free entries before it types a macro, so 7 (127 usable) is too small.
+// make ramsize leaves over 6 KB for the stack at 8.
+#define XPTQ_SHIFT            8      /* log2 of the output queue size, 1-8 */
+
+void xptq_init(void);
+uint8_t xptq_put(uint8_t sw, uint8_t state);
+void xptq_delay(uint16_t ticks);
+void xptq_write(uint8_t sw, uint8_t state);
+void xptq_hold(uint8_t sw, uint8_t state);
+void xptq_release_all(void);
+uint16_t xptq_get_saved(void);
+uint8_t xptq_get_hiwater(void);
+uint8_t xptq_get_free(void);
+uint16_t xptq_get_drops(void);
+void xptq_run(void);
+void xptq_sync(void);
+
+#endif
@@ -0,0 +1,432 @@
+/*
+ *  PETKey - VIC/64 to PET keyboard adapter
+ *  Copyright (C) 2021 Jim Brain and RETRO Innovations <go4retro@go4retro.com>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; version 2 of the License only.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ *  petscan.c: Host model of the PET keyboard scan, for the output pacing
+ *
+ *  xptq.c and vkb_pet.c are built for the host and type strings as the
+ *  firmware does, the scan interrupt called every scan tick.  A PET reads
+ *  the crosspoint switches a row at a time, once a jiffy, and its ROM
+ *  turns what it read into characters.  Every key the adapter closed must
+ *  come out once, in order and with the shift state it was closed with.
+ *  Each string is typed at many phases of the PET scan against the adapter
+ *  ticks, with the PET clock a little fast and slow, and with a ROM taking
+ *  the first or the last of two keys read down in one scan.
+ *
+ *  The PET model:
+ *  - a scan reads the 10 rows over PET_SCAN_NS, a 1 MHz 6502 looping over
+ *    80 keys takes about that
+ *  - BASIC 2 and 4 take a key the first scan it is read alone or first
+ *    (or last), and again only after a scan without it
+ *  - the original 2001 ROM wants the key in two scans running
+ *  - shift counts if it was read down during the scan taking the key
+ *
+ *  make petscan types the function key strings before and after shift
+ *  runs, then checks every pace_tbl profile against its PET and fails on
+ *  a lost key.  petscan -s finds the shortest hold and same per PET.
+ *
+ *  Built with CONFIG_PET_SYNC, the PET's last row read raises the sync
+ *  line, xptq_sync(), and the profiles are checked with the line wired
+ *  and with it not, the queue then on its own clock.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "../src/xptq.c"
+#include "../src/vkb_pet.c"
+
+#define NS_PER_SEC          1000000000LL
+// the scan tick, timer 0 in CTC mode at /256
+#define TICK_NS             (256LL * (F_CPU / 256 / SCAN_RATE) * NS_PER_SEC / F_CPU)
+#define PET_ROWS            10
+#define PET_COLS            8
+#define PET_SCAN_NS         1500000LL
+#define PET_ROW_NS          (PET_SCAN_NS / PET_ROWS)
+#define PET_NO_KEY          0xff
+// PET clock off by this many parts per thousand either way
+#define PET_TOLERANCE       5
+#define PHASES              50
+#define RUN_LIMIT_NS        (30 * NS_PER_SEC)
+#define OLD_JIFFY           KB_MS_TO_TICKS_UP(20)
+#define SEARCH_MAX          60
+#define SEARCH_GAP_MAX      3
+
+typedef struct {
+  const char *name;
+  long long jiffy_ns;     // time between scans
+  uint8_t scans;          // scans running a key must be read in
+  uint8_t pace;           // pace_tbl profile for it
+} pet_t;
+
+static const pet_t pets[] = {
+  {"BASIC 2/4, 50Hz", NS_PER_SEC / 50, 1, 0},
+  {"original ROM, 60Hz", NS_PER_SEC / 60, 2, 1},
+  {"BASIC 2/4, 60Hz", NS_PER_SEC / 60, 1, 2},
+  {"original ROM, 50Hz", NS_PER_SEC / 50, 2, 3},
+};
+
+#define PETS                (sizeof(pets) / sizeof(pets[0]))
+
+// the function key strings, as map_function_key() types them
+static const char fkeys[] = "directory\rf2\rdload \"*\"\rf4\rf5\rf6\rf7\rf8\r";
+
+// those, shift runs, and keys typed twice running
+static const char *const texts[] = {
+  fkeys,
+  "10 ? \"Hello, World!\":goto 10\r",
+  "aabb  cc..11!!\"\"ddEEff\r",
+};
+
+#define TEXTS               (sizeof(texts) / sizeof(texts[0]))
+
+typedef struct {
+  uint8_t sw;
+  uint8_t shift;
+} typed_t;
+
+static typed_t want[256];
+static typed_t got[256];
+static uint8_t nwant, ngot;
+static uint8_t seen[16];           // switches closed, as last seen
+static long long last_change;
+static uint16_t ticks;
+#ifdef PET_SYNC
+static uint8_t wired;               // PET row line to the sync input
+#endif
+
+// PET ROM state
+static uint8_t rom_key;            // last key taken
+static uint8_t rom_cand;           // key read in the last scans
+static uint8_t rom_run;            // scans running it was read
+static uint8_t rom_found;
+static uint8_t rom_shift;
+
+#define STUB_DEF8(n)        volatile uint8_t n;
+#define STUB_DEF16(n)       volatile uint16_t n;
+STUB_REGS(STUB_DEF8, STUB_DEF16)
+
+// the parts of the firmware the typing path does not reach
+uint16_t kb_get_ticks(void) { return ticks; }
+void kb_keep_awake(void) {}
+void kb_init(void) {}
+void kb_scan(void) {}
+void kb_sample(void) {}
+uint8_t kb_data_available(void) { return 0; }
+uint8_t kb_recv(void) { return 0; }
+void kb_set_repeat_delay(uint16_t ms) { (void)ms; }
+void kb_set_repeat_period(uint16_t ms) { (void)ms; }
+void kb_set_repeat_code(uint8_t code) { (void)code; }
+uint16_t kb_get_ghost_count(void) { return 0; }
+uint8_t kb_get_wake_latency(void) { return 0; }
+uint8_t kb_get_rx_hiwater(void) { return 0; }
+uint16_t kb_get_rx_drops(void) { return 0; }
+void kb_bench_decode(uint16_t *cycles) { (void)cycles; }
+void joy_init(void) {}
+void joy_scan(void) {}
+void joy_set_map(uint8_t port, uint8_t line, uint8_t sw) {
+  (void)port; (void)line; (void)sw;
+}
+void joy_set_autofire(uint8_t port, uint8_t hz, uint16_t min_ticks) {
+  (void)port; (void)hz; (void)min_ticks;
+}
+void debug_putc(uint8_t data) { (void)data; }
+void _debug_puts_P(const char *text) { (void)text; }
+void debug_puthex(uint8_t hex) { (void)hex; }
+void debug_putcrlf(void) {}
+kbm_results_t kbm_add(uint8_t key, uint8_t len, uint8_t *val) {
+  (void)key; (void)len; (void)val;
+  return KBMRES_TOO_LARGE;
+}
+kbm_results_t kbm_del(uint8_t key) { (void)key; return KBMRES_NOT_FOUND; }
+kbm_results_t kbm_find(uint8_t key, uint8_t *len, uint8_t *val) {
+  (void)key; (void)len; (void)val;
+  return KBMRES_NOT_FOUND;
+}
+uint8_t read_configuration(config_t *cfg) { (void)cfg; return FALSE; }
+void write_configuration(config_t *cfg) { (void)cfg; }
+
+static uint8_t is_closed(const uint8_t *sw, uint8_t n) {
+  return (sw[n >> 3] >> (n & 7)) & 1;
+}
+
+static uint8_t is_shift(uint8_t sw) {
+  return sw == MAT_PET_KEY_LSHIFT || sw == MAT_PET_KEY_RSHIFT;
+}
+
+// note the keys the adapter closed since the last look
+static void watch(long long now) {
+  uint8_t sw;
+  uint8_t shift;
+
+  if(!memcmp(seen, xptq_shadow, sizeof(seen)))
+    return;
+  last_change = now;
+  shift = is_closed(xptq_shadow, MAT_PET_KEY_LSHIFT)
+          | is_closed(xptq_shadow, MAT_PET_KEY_RSHIFT);
+  for(sw = 0; sw < 128; sw++) {
+    if(!is_shift(sw) && is_closed(xptq_shadow, sw) && !is_closed(seen, sw)) {
+      want[nwant].sw = sw;
+      want[nwant].shift = shift;
+      nwant++;
+    }
+  }
+  memcpy(seen, xptq_shadow, sizeof(seen));
+}
+
+// the PET reads a row, the ROM decides once all are read
+static void pet_row(const pet_t *pet, uint8_t row, uint8_t last) {
+  uint8_t col, sw;
+
+  if(!row) {
+    rom_found = PET_NO_KEY;
+    rom_shift = FALSE;
+  }
+  for(col = 0; col < PET_COLS; col++) {
+    sw = MATRIX_MAP(row, col);
+    if(!is_closed(xptq_shadow, sw))
+      continue;
+    if(is_shift(sw))
+      rom_shift = TRUE;
+    else if(last || rom_found == PET_NO_KEY)
+      rom_found = sw;
+  }
+  if(row < PET_ROWS - 1)
+    return;
+#ifdef PET_SYNC
+  if(wired)
+    xptq_sync();                    // the row line rises as the PET moves on
+#endif
+  if(rom_found == PET_NO_KEY) {
+    rom_key = PET_NO_KEY;
+    rom_run = 0;
+    return;
+  }
+  if(rom_found == rom_cand) {
+    if(rom_run < 0xff)
+      rom_run++;
+  } else {
+    rom_cand = rom_found;
+    rom_run = 1;
+  }
+  if(rom_run >= pet->scans && rom_found != rom_key) {
+    rom_key = rom_found;
+    got[ngot].sw = rom_found;
+    got[ngot].shift = rom_shift;
+    ngot++;
+  }
+}
+
+// the typing path before shift runs: shift with each key, a jiffy each way
+static void type_old(const char *str) {
+  char c;
+  uint8_t map, pshift;
+
+  for(; (c = *str); str++) {
+    pshift = (c > '@' && c < '[');
+    if(c == '\r')
+      map = MAT_PET_KEY_RETURN;
+    else
+      map = ascii_map[(c > '`' && c < '{' ? c & ~0x20 : c) - ' '];
+    if(pshift)
+      set_switch(MAT_PET_KEY_LSHIFT, TRUE);
+    set_switch(map, TRUE);
+    WAIT_TICKS(OLD_JIFFY);
+    set_switch(map, FALSE);
+    if(pshift)
+      set_switch(MAT_PET_KEY_LSHIFT, FALSE);
+    WAIT_TICKS(OLD_JIFFY);
+  }
+}
+
+static void type_new(const char *str) {
+  _map_ascii_string_P(str);
+}
+
+/*
+ * Type str against one PET, with its scans starting phase_ns in, jiffy_ns
+ * apart.  Returns the keys lost, doubled or with the wrong shift, and the
+ * time the adapter took in *ns.
+ */
+static uint8_t run(const pet_t *pet, long long jiffy_ns, long long phase_ns,
+                   uint8_t last, void (*type)(const char *), const char *str,
+                   long long *ns) {
+  long long now = 0;
+  long long tick = TICK_NS;
+  long long scan = phase_ns;
+  uint8_t row = 0;
+  uint8_t i, bad = 0;
+
+  ticks = 0;
+  nwant = ngot = 0;
+  memset(seen, 0, sizeof(seen));
+  last_change = 0;
+  rom_key = rom_cand = PET_NO_KEY;
+  rom_run = 0;
+#ifdef PET_SYNC
+  xptq_scans = 0;
+  xptq_lost = (wired ? 0 : XPTQ_SYNC_LOST);
+#endif
+  xptq_init();
+  plan_reset();
+  _type_sw = MAT_PET_KEY_NONE;
+
+  type(str);
+  watch(now);
+  while(now < RUN_LIMIT_NS) {
+    if(tick <= scan + row * PET_ROW_NS) {
+      now = tick;
+      tick += TICK_NS;
+      ticks++;
+      xptq_run();
+      watch(now);
+    } else {
+      now = scan + row * PET_ROW_NS;
+      pet_row(pet, row, last);
+      watch(now);
+      if(++row == PET_ROWS) {
+        row = 0;
+        scan += jiffy_ns;
+      }
+    }
+    if(xptq_ring_empty(&xptq) && now > last_change + 3 * jiffy_ns)
+      break;
+  }
+  *ns = last_change;
+  for(i = 0; i < nwant || i < ngot; i++) {
+    if(i >= nwant || i >= ngot || want[i].sw != got[i].sw
+       || want[i].shift != got[i].shift)
+      bad++;
+  }
+  return bad;
+}
+
+/*
+ * Type str at every phase, PET clock and ROM choice.  Returns the runs
+ * that lost a key, and the slowest rate seen in *cps.
+ */
+static uint16_t sweep(const pet_t *pet, void (*type)(const char *),
+                      const char *str, double *cps) {
+  long long ns, jiffy_ns;
+  int tol, phase;
+  uint8_t last;
+  uint16_t bad = 0;
+  double rate;
+
+  *cps = 1e9;
+  for(tol = -PET_TOLERANCE; tol <= PET_TOLERANCE; tol += PET_TOLERANCE) {
+    jiffy_ns = pet->jiffy_ns * (1000 + tol) / 1000;
+    for(phase = 0; phase < PHASES; phase++) {
+      for(last = FALSE; last <= TRUE; last++) {
+        if(run(pet, jiffy_ns, jiffy_ns * phase / PHASES, last, type, str, &ns))
+          bad++;
+        rate = (double)strlen(str) * NS_PER_SEC / ns;
+        if(rate < *cps)
+          *cps = rate;
+      }
+    }
+  }
+  return bad;
+}
+
+// all the strings with the current pace, returns the runs that lost a key
+static uint16_t sweep_all(const pet_t *pet) {
+  uint8_t i;
+  uint16_t bad = 0;
+  double cps;
+
+  for(i = 0; i < TEXTS; i++)
+    bad += sweep(pet, type_new, texts[i], &cps);
+  return bad;
+}
+
+// the shortest hold and same that lose no key, for a few gaps
+static void search(const pet_t *pet) {
+  uint16_t gap;
+  double cps;
+
+  printf("%s\n", pet->name);
+  for(gap = 0; gap <= SEARCH_GAP_MAX; gap++) {
+    _pace.gap = gap;
+    _pace.same = SEARCH_MAX;
+    for(_pace.hold = 1; _pace.hold < SEARCH_MAX; _pace.hold++) {
+      if(!sweep_all(pet))
+        break;
+    }
+    for(_pace.same = 1; _pace.same < SEARCH_MAX; _pace.same++) {
+      if(!sweep_all(pet))
+        break;
+    }
+    sweep(pet, type_new, fkeys, &cps);
+    printf("  gap %2u: hold %2u same %2u ticks, %5.1f/s\n",
+           gap, _pace.hold, _pace.same, cps);
+  }
+}
+
+/*
+ * Every profile against its PET, returns the runs that lost a key.  With
+ * before, the typing before shift runs is timed, too.
+ */
+static uint16_t check(uint8_t before) {
+  uint8_t i;
+  uint16_t bad, fails = 0;
+  double cps;
+
+  printf("function keys, %u chars, %u runs per PET\n",
+         (unsigned)strlen(fkeys), 3 * PHASES * 2);
+  for(i = 0; i < PETS; i++) {
+    printf("%-20s", pets[i].name);
+    if(before) {
+      bad = sweep(&pets[i], type_old, fkeys, &cps);
+      printf("  before: %5.1f/s %3u bad", cps, bad);
+    }
+    _cfg.pace = pets[i].pace;
+    set_pace();
+    bad = sweep(&pets[i], type_new, fkeys, &cps);
+    printf("  %s: %5.1f/s %3u bad", (before ? "after" : "rate"), cps, bad);
+    bad = sweep_all(&pets[i]);
+    printf(", profile %u: %u bad\n", pets[i].pace, bad);
+    fails += bad;
+  }
+  return fails;
+}
+
+int main(int argc, char **argv) {
+  uint8_t i;
+  uint16_t fails = 0;
+
+  if(PETS != PACE_TBL_SZ) {
+    printf("pets[] and pace_tbl differ\n");
+    return 1;
+  }
+  if(argc > 1 && !strcmp(argv[1], "-s")) {
+    for(i = 0; i < PETS; i++)
+      search(&pets[i]);
+    return 0;
+  }
+#ifdef PET_SYNC
+  for(wired = TRUE; ; wired = FALSE) {
+    printf("PET_SYNC, %s\n", (wired ? "row line wired"
+                                     : "no row line, own clock"));
+    fails += check(FALSE);
+    if(!wired)
+      break;
+  }
+#else
+  fails = check(TRUE);
+#endif
+  return fails ? 1 : 0;
+}
@@ -0,0 +1,19 @@
+/*
+ *  petscan host build: no EEPROM, petscan.c stubs the calls.
+ */
+
+#ifndef STUB_EEPROM_H
+#define STUB_EEPROM_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define EEMEM
+#define eeprom_is_ready()   1
+
+uint8_t eeprom_read_byte(const uint8_t *p);
+void eeprom_update_byte(uint8_t *p, uint8_t val);
+void eeprom_read_block(void *dst, const void *src, size_t len);
+void eeprom_update_block(const void *src, void *dst, size_t len);
+
+#endif
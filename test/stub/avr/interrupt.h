@@ -0,0 +1,12 @@
+/*
+ *  petscan host build: interrupts are called by the simulation.
+ */
+
+#ifndef STUB_INTERRUPT_H
+#define STUB_INTERRUPT_H
+
+#define ISR(v, ...)         void v(void); void v(void)
+#define sei()               do {} while(0)
+#define cli()               do {} while(0)
+
+#endif
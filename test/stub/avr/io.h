@@ -0,0 +1,122 @@
+/*
+ *  petscan host build: AVR registers as plain variables, bit numbers as
+ *  on the ATmega2560.  petscan.c defines the variables.
+ */
+
+#ifndef STUB_IO_H
+#define STUB_IO_H
+
+#include <stdint.h>
+
+#define _BV(b)              (1 << (b))
+
+#define STUB_REGS(R8, R16) \
+  R8(PORTA) R8(PINA) R8(DDRA) R8(PORTB) R8(PINB) \
+  R8(DDRB) R8(PORTC) R8(PINC) R8(DDRC) R8(PORTD) R8(PIND) \
+  R8(DDRD) R8(PORTE) R8(PINE) R8(DDRE) R8(PORTF) R8(PINF) \
+  R8(DDRF) R8(PORTG) R8(PING) R8(DDRG) R8(PORTH) R8(PINH) \
+  R8(DDRH) R8(PORTJ) R8(PINJ) R8(DDRJ) R8(PORTK) R8(PINK) \
+  R8(DDRK) R8(PORTL) R8(PINL) R8(DDRL) R8(TCCR0A) R8(TCCR0B) \
+  R8(OCR0A) R8(OCR0B) R8(TIMSK0) R8(TIFR0) R8(TCNT0) R8(TCCR1A) \
+  R8(TCCR1B) R8(TIMSK1) R8(TIFR1) R8(PCICR) R8(PCIFR) R8(PCMSK0) \
+  R8(PCMSK1) R8(PCMSK2) R8(EICRA) R8(EIMSK) R8(EIFR) R8(GPIOR0) \
+  R8(GPIOR1) R8(GPIOR2) R8(SMCR) R8(MCUCR) R8(SREG) R8(UDR0) \
+  R8(UCSR0A) R8(UCSR0B) R8(UCSR0C) R8(UBRR0H) R8(UBRR0L) R8(UDR1) \
+  R8(UCSR1A) R8(UCSR1B) R8(UCSR1C) R8(UBRR1H) R8(UBRR1L) \
+  R16(TCNT1) R16(OCR1A)
+
+#define STUB_EXTERN8(n)     extern volatile uint8_t n;
+#define STUB_EXTERN16(n)    extern volatile uint16_t n;
+STUB_REGS(STUB_EXTERN8, STUB_EXTERN16)
+
+enum { PIN0, PIN1, PIN2, PIN3, PIN4, PIN5, PIN6, PIN7 };
+
+#define PB0 0
+#define PB1 1
+#define PB2 2
+#define PB3 3
+#define PB4 4
+#define PB5 5
+#define PB6 6
+#define PB7 7
+#define PH0 0
+#define PH1 1
+#define PH3 3
+#define PH4 4
+#define PH5 5
+#define PH6 6
+#define PG0 0
+#define PG1 1
+#define PG5 5
+#define PD0 0
+#define PD1 1
+#define PD2 2
+#define PD3 3
+#define PE3 3
+#define PE4 4
+#define PE5 5
+#define WGM01 1
+#define WGM00 0
+#define WGM02 3
+#define CS00 0
+#define CS01 1
+#define CS02 2
+#define CS10 0
+#define CS11 1
+#define CS12 2
+#define WGM12 3
+#define OCIE0A 1
+#define OCIE0B 2
+#define OCF0A 1
+#define OCF0B 2
+#define OCIE1A 1
+#define OCF1A 1
+#define TOIE0 0
+#define PCIE0 0
+#define PCIE1 1
+#define PCIE2 2
+#define PCIF0 0
+#define PCIF1 1
+#define PCIF2 2
+#define INT0 0
+#define INT1 1
+#define INT2 2
+#define INT3 3
+#define INTF0 0
+#define ISC00 0
+#define ISC01 1
+#define ISC10 2
+#define ISC11 3
+#define ISC20 4
+#define ISC21 5
+#define ISC30 6
+#define ISC31 7
+#define UDRE0 5
+#define TXCIE0 6
+#define TXEN0 3
+#define UCSZ00 1
+#define UCSZ01 2
+#define UPM00 4
+#define UPM01 5
+#define USBS0 3
+#define TXC0 6
+#define UDRIE0 5
+#define U2X0 1
+#define UDRE1 5
+#define TXCIE1 6
+#define TXEN1 3
+#define UCSZ10 1
+#define UCSZ11 2
+#define UPM10 4
+#define UPM11 5
+#define USBS1 3
+#define TXC1 6
+#define UDRIE1 5
+#define U2X1 1
+#define SE 0
+#define loop_until_bit_is_set(r,b) do {} while(!((r) & _BV(b)))
+#define bit_is_set(r,b) ((r) & _BV(b))
+#define bit_is_clear(r,b) (!((r) & _BV(b)))
+#define JTD 7
+
+#endif
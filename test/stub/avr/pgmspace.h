@@ -0,0 +1,21 @@
+/*
+ *  petscan host build: flash is plain memory.
+ */
+
+#ifndef STUB_PGMSPACE_H
+#define STUB_PGMSPACE_H
+
+#include <stdint.h>
+#include <string.h>
+
+#define PROGMEM
+#define PSTR(s)             (s)
+#define pgm_read_byte(a)    (*(const uint8_t *)(a))
+#define pgm_read_word(a)    (*(const uint16_t *)(a))
+#define pgm_read_ptr(a)     (*(void * const *)(a))
+#define memcpy_P            memcpy
+#define strcpy_P            strcpy
+#define strlen_P            strlen
+#define strcmp_P            strcmp
+
+#endif
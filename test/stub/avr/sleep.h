@@ -0,0 +1,14 @@
+/*
+ *  petscan host build: the simulation never sleeps.
+ */
+
+#ifndef STUB_SLEEP_H
+#define STUB_SLEEP_H
+
+#define SLEEP_MODE_IDLE     0
+#define set_sleep_mode(m)   do {} while(0)
+#define sleep_enable()      do {} while(0)
+#define sleep_disable()     do {} while(0)
+#define sleep_cpu()         do {} while(0)
+
+#endif
@@ -0,0 +1,12 @@
+/*
+ *  petscan host build: one thread, every block is atomic.
+ */
+
+#ifndef STUB_ATOMIC_H
+#define STUB_ATOMIC_H
+
+#define ATOMIC_BLOCK(t)     for(int atomic_once = 1; atomic_once; atomic_once = 0)
+#define ATOMIC_RESTORESTATE
+#define ATOMIC_FORCEON
+
+#endif
@@ -0,0 +1,11 @@
+/*
+ *  petscan host build: busy waits take no simulated time.
+ */
+
+#ifndef STUB_DELAY_H
+#define STUB_DELAY_H
+
+#define _delay_ms(ms)       do {} while(0)
+#define _delay_us(us)       do {} while(0)
+
+#endif